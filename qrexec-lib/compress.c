@@ -0,0 +1,121 @@
+/*
+ * Block compression for QFILE_FEATURE_ZSTD and QFILE_FEATURE_LZ4.  Both
+ * codecs are optional at build time; without them no compression feature
+ * is offered or accepted.
+ */
+
+#include <stdlib.h>
+#include "compress.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+uint32_t compress_features(void)
+{
+    uint32_t features = 0;
+
+#ifdef HAVE_ZSTD
+    features |= QFILE_FEATURE_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+    features |= QFILE_FEATURE_LZ4;
+#endif
+    return features;
+}
+
+enum qfile_codec compress_codec(uint32_t features)
+{
+    features &= compress_features();
+    if (features & QFILE_FEATURE_ZSTD)
+        return QFILE_CODEC_ZSTD;
+    if (features & QFILE_FEATURE_LZ4)
+        return QFILE_CODEC_LZ4;
+    return 0;
+}
+
+void compress_level_range(enum qfile_codec codec, int *min, int *max, int *def)
+{
+    if (codec == QFILE_CODEC_LZ4) {
+        /* "level" -n is acceleration n + 1 */
+        *min = -16;
+        *max = 0;
+        *def = 0;
+    } else {
+        /* higher levels are too slow to keep up with a pipe anyway */
+        *min = -5;
+        *max = 9;
+        *def = 3;
+    }
+}
+
+size_t compress_block(struct compress_state *cs, enum qfile_codec codec,
+                      int level, void *out, const void *in, size_t in_len)
+{
+    if (in_len < 2)
+        return 0;
+    switch (codec) {
+#ifdef HAVE_ZSTD
+        case QFILE_CODEC_ZSTD: {
+            size_t ret;
+            if (!cs->zstd_cctx && !(cs->zstd_cctx = ZSTD_createCCtx()))
+                return 0;
+            ret = ZSTD_compressCCtx(cs->zstd_cctx, out, in_len - 1, in, in_len, level);
+            return ZSTD_isError(ret) ? 0 : ret;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case QFILE_CODEC_LZ4: {
+            int ret = LZ4_compress_fast(in, out, in_len, in_len - 1, 1 - level);
+            return ret > 0 ? (size_t)ret : 0;
+        }
+#endif
+        default:
+            (void)cs;
+            (void)level;
+            (void)out;
+            (void)in;
+            return 0;
+    }
+}
+
+int decompress_block(struct compress_state *cs, enum qfile_codec codec,
+                     void *out, size_t out_len, const void *in, size_t in_len)
+{
+    switch (codec) {
+#ifdef HAVE_ZSTD
+        case QFILE_CODEC_ZSTD: {
+            size_t ret;
+            if (!cs->zstd_dctx && !(cs->zstd_dctx = ZSTD_createDCtx()))
+                return -1;
+            /* single pass into out, which bounds the memory used */
+            ret = ZSTD_decompressDCtx(cs->zstd_dctx, out, out_len, in, in_len);
+            return !ZSTD_isError(ret) && ret == out_len ? 0 : -1;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case QFILE_CODEC_LZ4:
+            return LZ4_decompress_safe(in, out, in_len, out_len) == (int)out_len ? 0 : -1;
+#endif
+        default:
+            (void)cs;
+            (void)out;
+            (void)out_len;
+            (void)in;
+            (void)in_len;
+            return -1;
+    }
+}
+
+void compress_state_free(struct compress_state *cs)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(cs->zstd_cctx);
+    ZSTD_freeDCtx(cs->zstd_dctx);
+#endif
+    cs->zstd_cctx = NULL;
+    cs->zstd_dctx = NULL;
+}
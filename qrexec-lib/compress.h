@@ -0,0 +1,31 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libqubes-rpc-filecopy.h"
+
+/* codec contexts of one transfer, zero-initialized */
+struct compress_state {
+    void *zstd_cctx;
+    void *zstd_dctx;
+};
+
+/* QFILE_FEATURE_* bits of the codecs built in */
+uint32_t compress_features(void);
+/* the codec to use for the given (negotiated) features, or 0 */
+enum qfile_codec compress_codec(uint32_t features);
+/* levels from fastest to best compression, and the default */
+void compress_level_range(enum qfile_codec codec, int *min, int *max, int *def);
+/*
+ * Compress a block into out (in_len - 1 bytes).  Returns the compressed
+ * length, or 0 if the result would not be smaller than the input.
+ */
+size_t compress_block(struct compress_state *cs, enum qfile_codec codec,
+                      int level, void *out, const void *in, size_t in_len);
+/* returns 0 if in decompresses to exactly out_len bytes, -1 otherwise */
+int decompress_block(struct compress_state *cs, enum qfile_codec codec,
+                     void *out, size_t out_len, const void *in, size_t in_len);
+void compress_state_free(struct compress_state *cs);
+
+#endif /* _COMPRESS_H */
@@ -1,26 +1,146 @@
+#define _GNU_SOURCE /* For splice(). */
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "ioall.h"
 #include "libqubes-rpc-filecopy.h"
 #include "crc32.h"
+#include "ctx.h"
 
-notify_progress_t *notify_progress_func = NULL;
-void register_notify_progress(notify_progress_t *func)
+/* files smaller than this are not worth the extra fstat() calls */
+#define SPLICE_MIN_SIZE (64 * 1024)
+/* how much data is spliced at once */
+#define SPLICE_CHUNK (1024 * 1024)
+
+/*
+ * Returns -1 on error; *done is what was moved before it, less than len on
+ * success only on EOF of infd.
+ */
+static int splice_all(int infd, int outfd, size_t len, size_t *done)
 {
-    notify_progress_func = func;
+    ssize_t ret;
+
+    *done = 0;
+    while (*done < len) {
+        ret = splice(infd, NULL, outfd, NULL, len - *done,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+        *done += ret;
+    }
+    return 0;
 }
 
-int copy_file(int outfd, int infd, long long size, unsigned long *crc32)
+/*
+ * Regular file -> pipe, only without a checksum: it could not be taken from
+ * exactly the bytes that get spliced, if the file is modified meanwhile.
+ */
+static int splice_file_to_pipe(struct qfile_ctx *ctx, int outfd, int infd, long long size,
+        long long *written)
+{
+    size_t count, done;
+
+    while (*written < size) {
+        if (size - *written > SPLICE_CHUNK)
+            count = SPLICE_CHUNK;
+        else
+            count = size - *written;
+        if (splice_all(infd, outfd, count, &done) < 0) {
+            /* nothing moved yet, the fallback can take over */
+            if (*written == 0 && done == 0 && (errno == EINVAL || errno == ENOSYS))
+                return -1;
+            return errno == EPIPE ? COPY_FILE_WRITE_ERROR : COPY_FILE_READ_ERROR;
+        }
+        if (done < count)
+            return COPY_FILE_READ_EOF;
+        qfile_notify_progress(ctx, done, 0);
+        *written += done;
+    }
+    return COPY_FILE_OK;
+}
+
+/* Pipe -> regular file, also only without a checksum. */
+static int splice_pipe_to_file(struct qfile_ctx *ctx, int outfd, int infd, long long size,
+        long long *written)
+{
+    size_t count, done;
+    ssize_t ret;
+
+    while (*written < size) {
+        if (size - *written > SPLICE_CHUNK)
+            count = SPLICE_CHUNK;
+        else
+            count = size - *written;
+        for (done = 0; done < count; done += ret) {
+            ret = splice(infd, NULL, outfd, NULL, count - done,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (ret == -1 && errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            if (ret < 0 && *written == 0 && done == 0 &&
+                    (errno == EINVAL || errno == ENOSYS))
+                return -1;
+            if (ret < 0)
+                return COPY_FILE_WRITE_ERROR;
+            if (ret == 0)
+                return COPY_FILE_READ_EOF;
+        }
+        qfile_notify_progress(ctx, count, 0);
+        *written += count;
+    }
+    return COPY_FILE_OK;
+}
+
+/*
+ * Try zero-copy transfer. Returns -1 if the fds are not suitable for it (or
+ * a checksum is wanted) and nothing was transferred yet, a COPY_FILE_*
+ * status otherwise.
+ */
+static int copy_file_splice(struct qfile_ctx *ctx, int outfd, int infd, long long size,
+        unsigned long *crc32, long long *written)
+{
+    struct stat in_st, out_st;
+    int out_flags;
+
+    if (size < SPLICE_MIN_SIZE || crc32)
+        return -1;
+    if (fstat(infd, &in_st) || fstat(outfd, &out_st))
+        return -1;
+    if (S_ISREG(in_st.st_mode) && S_ISFIFO(out_st.st_mode))
+        return splice_file_to_pipe(ctx, outfd, infd, size, written);
+    if (S_ISFIFO(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        out_flags = fcntl(outfd, F_GETFL);
+        if (out_flags == -1 || (out_flags & O_APPEND))
+            return -1;
+        return splice_pipe_to_file(ctx, outfd, infd, size, written);
+    }
+    return -1;
+}
+
+int copy_file_ctx(struct qfile_ctx *ctx, int outfd, int infd, long long size,
+                  unsigned long *crc32)
 {
     char buf[4096];
     long long written = 0;
     int ret;
     int count;
+
+    ret = copy_file_splice(ctx, outfd, infd, size, crc32, &written);
+    if (ret >= 0)
+        return ret;
+    /* splice not possible, or it bailed out before transferring anything */
     while (written < size) {
         if (size - written > (int)sizeof(buf))
             count = sizeof buf;
         else
             count = size - written;
-        ret = read(infd, buf, count);
+        ret = qfile_read(ctx, infd, buf, count);
         if (!ret)
             return COPY_FILE_READ_EOF;
         if (ret < 0)
@@ -28,15 +148,19 @@ int copy_file(int outfd, int infd, long long size, unsigned long *crc32)
         /* acumulate crc32 if requested */
         if (crc32)
             *crc32 = Crc32_ComputeBuf(*crc32, buf, ret);
-        if (!write_all(outfd, buf, ret))
+        if (!qfile_write_all(ctx, outfd, buf, ret))
             return COPY_FILE_WRITE_ERROR;
-        if (notify_progress_func != NULL)
-            notify_progress_func(ret, 0);
+        qfile_notify_progress(ctx, ret, 0);
         written += ret;
     }
     return COPY_FILE_OK;
 }
 
+int copy_file(int outfd, int infd, long long size, unsigned long *crc32)
+{
+    return copy_file_ctx(qfile_default_ctx(), outfd, infd, size, crc32);
+}
+
 const char * copy_file_status_to_str(int status)
 {
     switch (status) {
@@ -0,0 +1,79 @@
+/*
+ * Generates lookup tables for the slicing-by-N CRC-32 implementation in
+ * crc32.c.  Row 0 is the classic byte-at-a-time table; row k gives the CRC
+ * contribution of a byte followed by k zero bytes.  Also generates the
+ * x^(2^n) mod P(x) table used by Crc32_Combine().
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <err.h>
+
+#define CRC32_POLY 0xEDB88320 /* reflected 0x04C11DB7, as in gzip */
+#define CRC32_SLICES 16
+
+/* multiply a(x) by b(x) modulo P(x), in the bit-reflected representation */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+int main(void)
+{
+    static uint32_t table[CRC32_SLICES][256];
+    uint32_t crc, x2n;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (-(crc & 1) & CRC32_POLY);
+        table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < CRC32_SLICES; j++)
+            table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xFF];
+
+    if (printf("/* generated by crc32-generator, do not edit */\n"
+                "static const uint32_t crc32_table[%d][256] = {\n",
+                CRC32_SLICES) < 0)
+        err(1, "printf()");
+    for (j = 0; j < CRC32_SLICES; j++) {
+        if (printf("  {\n") < 0)
+            err(1, "printf()");
+        for (i = 0; i < 256; i++) {
+            if (printf("%s0x%08" PRIX32 ",%s", i % 6 ? "" : "   ",
+                        table[j][i], i % 6 == 5 || i == 255 ? "\n" : "") < 0)
+                err(1, "printf()");
+        }
+        if (printf("  },\n") < 0)
+            err(1, "printf()");
+    }
+    if (printf("};\n\n") < 0)
+        err(1, "printf()");
+
+    /* x^1, then square it 31 times */
+    x2n = (uint32_t)1 << 30;
+    if (printf("static const uint32_t crc32_x2n_table[32] = {\n") < 0)
+        err(1, "printf()");
+    for (i = 0; i < 32; i++) {
+        if (printf("%s0x%08" PRIX32 ",%s", i % 6 ? "" : "   ",
+                    x2n, i % 6 == 5 || i == 31 ? "\n" : "") < 0)
+            err(1, "printf()");
+        x2n = multmodp(x2n, x2n);
+    }
+    if (printf("};\n") < 0)
+        err(1, "printf()");
+    return 0;
+}
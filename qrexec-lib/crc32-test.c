@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libqubes-rpc-filecopy.h"
+#ifdef NDEBUG
+// without assertions this test program would not test anything
+# error "CRC-32 test program does not work without assertions."
+#endif
+#include <assert.h>
+
+static const enum crc32_impl impls[] = {
+    CRC32_IMPL_BYTEWISE,
+    CRC32_IMPL_SLICE8,
+    CRC32_IMPL_SLICE16,
+    CRC32_IMPL_PCLMUL,
+    CRC32_IMPL_ARMV8,
+};
+
+#define N_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+int main(void)
+{
+    static unsigned char buf[65536 + 64];
+    unsigned long ref, crc;
+    size_t i, off, len;
+
+    srandom(1);
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = random();
+
+    for (i = 0; i < N_IMPLS; i++) {
+        if (Crc32_SetImplementation(impls[i])) {
+            fprintf(stderr, "skipping unavailable CRC-32 kernel %d\n", impls[i]);
+            continue;
+        }
+        /* the standard check value */
+        assert(Crc32_ComputeBuf(0, "123456789", 9) == 0xCBF43926);
+        assert(Crc32_ComputeBuf(0, "", 0) == 0);
+        /* continuing a CRC must match computing it in one go */
+        crc = Crc32_ComputeBuf(0, "1234", 4);
+        assert(Crc32_ComputeBuf(crc, "56789", 5) == 0xCBF43926);
+    }
+
+    /* all kernels must agree for every alignment and tail length */
+    for (off = 0; off < 64; off += 3) {
+        for (len = 0; len < 300; len++) {
+            assert(!Crc32_SetImplementation(CRC32_IMPL_BYTEWISE));
+            ref = Crc32_ComputeBuf(0, buf + off, len);
+            for (i = 0; i < N_IMPLS; i++) {
+                if (Crc32_SetImplementation(impls[i]))
+                    continue;
+                crc = Crc32_ComputeBuf(0, buf + off, len);
+                if (crc != ref) {
+                    fprintf(stderr, "BUG: %s: crc mismatch at offset %zu length %zu\n",
+                            Crc32_ImplementationName(), off, len);
+                    abort();
+                }
+            }
+        }
+    }
+    assert(!Crc32_SetImplementation(CRC32_IMPL_BYTEWISE));
+    ref = Crc32_ComputeBuf(0, buf, sizeof(buf));
+    for (i = 0; i < N_IMPLS; i++) {
+        if (Crc32_SetImplementation(impls[i]))
+            continue;
+        assert(Crc32_ComputeBuf(0, buf, sizeof(buf)) == ref);
+    }
+    assert(!Crc32_SetImplementation(CRC32_IMPL_AUTO));
+
+    /* combining CRCs of adjacent chunks must match the CRC of the whole */
+    ref = Crc32_ComputeBuf(0, buf, sizeof(buf));
+    for (len = 0; len <= sizeof(buf); len += len < 100 ? 1 : 4093) {
+        unsigned long crc_a = Crc32_ComputeBuf(0, buf, len);
+        unsigned long crc_b = Crc32_ComputeBuf(0, buf + len, sizeof(buf) - len);
+        assert(Crc32_Combine(crc_a, crc_b, sizeof(buf) - len) == ref);
+    }
+    assert(Crc32_Combine(0xCBF43926, 0, 0) == 0xCBF43926);
+    assert(Crc32_Combine(Crc32_ComputeBuf(0, "1234", 4),
+                         Crc32_ComputeBuf(0, "56789", 5), 5) == 0xCBF43926);
+    return 0;
+}
@@ -17,17 +17,356 @@
  *  v1.0.3: replaced CRC constant table by generator function.
  *  v1.0.4: reformatted code, made ANSI C.  1994-12-05.
  *  v2.0.0: rewrote to use memory buffer & static table, 2006-04-29.
+ *
+ *  Qubes: added generated slicing-by-8/16 tables and selectable kernels,
+ *  hardware accelerated kernels (PCLMULQDQ folding, ARMv8 CRC32), and
+ *  Crc32_Combine() based on zlib's crc32_combine().
 \*----------------------------------------------------------------------------*/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#include "libqubes-rpc-filecopy.h"
+#include "crc32.h"
+
+#include "crc32-table.c"
+
+typedef uint32_t (crc32_kernel_t)(uint32_t crc, const unsigned char *buf,
+                                  size_t bufLen);
 
 /*----------------------------------------------------------------------------*\
  *  Local functions
 \*----------------------------------------------------------------------------*/
 
-unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
-                                       size_t bufLen );
+static uint32_t crc32_bytewise(uint32_t crc, const unsigned char *buf,
+                               size_t bufLen)
+{
+    size_t i;
+
+    for (i = 0; i < bufLen; i++)
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ buf[i]) & 0xFF];
+    return crc;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * Slicing-by-N: fold N input bytes into the CRC with N independent table
+ * lookups, see "A Systematic Approach to Building High Performance,
+ * Software-based, CRC Generators" (Kounavis, Berry).  Only little-endian
+ * machines are handled, others use the bytewise kernel.
+ */
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *buf,
+                             size_t bufLen)
+{
+    uint32_t w0, w1;
+
+    for (; bufLen && ((uintptr_t)buf & 7); bufLen--, buf++)
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *buf) & 0xFF];
+    for (; bufLen >= 8; bufLen -= 8, buf += 8) {
+        memcpy(&w0, buf, 4);
+        memcpy(&w1, buf + 4, 4);
+        w0 ^= crc;
+        crc = crc32_table[7][w0 & 0xFF] ^
+              crc32_table[6][(w0 >> 8) & 0xFF] ^
+              crc32_table[5][(w0 >> 16) & 0xFF] ^
+              crc32_table[4][w0 >> 24] ^
+              crc32_table[3][w1 & 0xFF] ^
+              crc32_table[2][(w1 >> 8) & 0xFF] ^
+              crc32_table[1][(w1 >> 16) & 0xFF] ^
+              crc32_table[0][w1 >> 24];
+    }
+    return crc32_bytewise(crc, buf, bufLen);
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const unsigned char *buf,
+                              size_t bufLen)
+{
+    uint32_t w0, w1, w2, w3;
+
+    for (; bufLen && ((uintptr_t)buf & 7); bufLen--, buf++)
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *buf) & 0xFF];
+    for (; bufLen >= 16; bufLen -= 16, buf += 16) {
+        memcpy(&w0, buf, 4);
+        memcpy(&w1, buf + 4, 4);
+        memcpy(&w2, buf + 8, 4);
+        memcpy(&w3, buf + 12, 4);
+        w0 ^= crc;
+        crc = crc32_table[15][w0 & 0xFF] ^
+              crc32_table[14][(w0 >> 8) & 0xFF] ^
+              crc32_table[13][(w0 >> 16) & 0xFF] ^
+              crc32_table[12][w0 >> 24] ^
+              crc32_table[11][w1 & 0xFF] ^
+              crc32_table[10][(w1 >> 8) & 0xFF] ^
+              crc32_table[9][(w1 >> 16) & 0xFF] ^
+              crc32_table[8][w1 >> 24] ^
+              crc32_table[7][w2 & 0xFF] ^
+              crc32_table[6][(w2 >> 8) & 0xFF] ^
+              crc32_table[5][(w2 >> 16) & 0xFF] ^
+              crc32_table[4][w2 >> 24] ^
+              crc32_table[3][w3 & 0xFF] ^
+              crc32_table[2][(w3 >> 8) & 0xFF] ^
+              crc32_table[1][(w3 >> 16) & 0xFF] ^
+              crc32_table[0][w3 >> 24];
+    }
+    return crc32_slice8(crc, buf, bufLen);
+}
+#endif
+
+#if defined(__x86_64__)
+/*
+ * Fold 16-byte blocks with carry-less multiplication, then Barrett-reduce to
+ * 32 bits, as described in "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction" (Gopal, Ozturk et al., Intel, 2009).  The constants
+ * are the bit-reflected ones for the gzip polynomial from that paper.
+ * 'len' must be at least 64 and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const unsigned char *buf,
+                                  size_t len)
+{
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold 4x128 bits in parallel */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold into a single 128-bit value */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* remaining 16-byte blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf,
+                             size_t bufLen)
+{
+    size_t len = bufLen & ~(size_t)15;
+
+    if (bufLen < 64)
+        return crc32_slice16(crc, buf, bufLen);
+    crc = crc32_pclmul_fold(crc, buf, len);
+    return crc32_slice16(crc, buf + len, bufLen - len);
+}
+
+static int crc32_pclmul_supported(void)
+{
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+#if defined(__aarch64__)
+/* the ARMv8 CRC32X/CRC32B instructions use the gzip polynomial */
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf,
+                            size_t bufLen)
+{
+    uint64_t w;
+
+    for (; bufLen && ((uintptr_t)buf & 7); bufLen--, buf++)
+        crc = __crc32b(crc, *buf);
+    for (; bufLen >= 8; bufLen -= 8, buf += 8) {
+        memcpy(&w, buf, 8);
+        crc = __crc32d(crc, w);
+    }
+    for (; bufLen; bufLen--, buf++)
+        crc = __crc32b(crc, *buf);
+    return crc;
+}
+
+static int crc32_armv8_supported(void)
+{
+    return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#endif
+
+static const struct {
+    const char *name;
+    crc32_kernel_t *kernel;
+    /* NULL if always available */
+    int (*supported)(void);
+} crc32_impls[] = {
+    [CRC32_IMPL_BYTEWISE] = { "bytewise", crc32_bytewise, NULL },
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    [CRC32_IMPL_SLICE8] = { "slice8", crc32_slice8, NULL },
+    [CRC32_IMPL_SLICE16] = { "slice16", crc32_slice16, NULL },
+#endif
+#if defined(__x86_64__)
+    [CRC32_IMPL_PCLMUL] = { "pclmul", crc32_pclmul, crc32_pclmul_supported },
+#endif
+#if defined(__aarch64__)
+    [CRC32_IMPL_ARMV8] = { "armv8", crc32_armv8, crc32_armv8_supported },
+#endif
+};
+
+/* in order of preference */
+static const enum crc32_impl crc32_auto_order[] = {
+    CRC32_IMPL_PCLMUL,
+    CRC32_IMPL_ARMV8,
+    CRC32_IMPL_SLICE16,
+    CRC32_IMPL_BYTEWISE,
+};
+
+static crc32_kernel_t crc32_resolve;
+/*
+ * Accessed atomically: the unpack worker pool and the stripe channel threads
+ * compute CRCs concurrently.
+ */
+static enum crc32_impl crc32_impl = CRC32_IMPL_AUTO;
+static crc32_kernel_t *crc32_kernel = crc32_resolve;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static int crc32_impl_available(enum crc32_impl impl)
+{
+    if ((size_t)impl >= sizeof(crc32_impls) / sizeof(crc32_impls[0]) ||
+            !crc32_impls[impl].kernel)
+        return 0;
+    return !crc32_impls[impl].supported || crc32_impls[impl].supported();
+}
+
+static enum crc32_impl crc32_auto_select(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(crc32_auto_order) / sizeof(crc32_auto_order[0]); i++)
+        if (crc32_impl_available(crc32_auto_order[i]))
+            return crc32_auto_order[i];
+    return CRC32_IMPL_BYTEWISE;
+}
+
+static void crc32_set_kernel(enum crc32_impl impl)
+{
+    __atomic_store_n(&crc32_impl, impl, __ATOMIC_RELEASE);
+    __atomic_store_n(&crc32_kernel, crc32_impls[impl].kernel, __ATOMIC_RELEASE);
+}
+
+/* run once, unless an implementation was selected explicitly before */
+static void crc32_init(void)
+{
+    if (__atomic_load_n(&crc32_impl, __ATOMIC_ACQUIRE) == CRC32_IMPL_AUTO)
+        crc32_set_kernel(crc32_auto_select());
+}
+
+/*
+ * Initial value of crc32_kernel: pick the best kernel for this CPU on first
+ * use.
+ */
+static uint32_t crc32_resolve(uint32_t crc, const unsigned char *buf,
+                              size_t bufLen)
+{
+    crc32_kernel_t *kernel;
+
+    pthread_once(&crc32_once, crc32_init);
+    kernel = __atomic_load_n(&crc32_kernel, __ATOMIC_ACQUIRE);
+    return kernel(crc, buf, bufLen);
+}
+
+/*----------------------------------------------------------------------------*\
+ *  NAME:
+ *     Crc32_SetImplementation() - selects the CRC-32 kernel
+ *  DESCRIPTION:
+ *     Makes Crc32_ComputeBuf() use the given implementation.  All of them
+ *     compute the same values; this is meant for benchmarking and testing.
+ *     CRC32_IMPL_AUTO selects the fastest one supported by the CPU, which
+ *     is also what happens on the first Crc32_ComputeBuf() call if no
+ *     implementation was selected before.
+ *  RETURNS:
+ *     0 on success, -1 if the implementation is not available on this
+ *     machine
+\*----------------------------------------------------------------------------*/
+
+int Crc32_SetImplementation(enum crc32_impl impl)
+{
+    if (impl == CRC32_IMPL_AUTO)
+        impl = crc32_auto_select();
+    if (!crc32_impl_available(impl))
+        return -1;
+    crc32_set_kernel(impl);
+    return 0;
+}
+
+const char *Crc32_ImplementationName(void)
+{
+    pthread_once(&crc32_once, crc32_init);
+    return crc32_impls[__atomic_load_n(&crc32_impl, __ATOMIC_ACQUIRE)].name;
+}
 
 /*----------------------------------------------------------------------------*\
  *  NAME:
@@ -50,57 +389,72 @@ unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
 unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
                                        size_t bufLen )
 {
-    static const unsigned long crcTable[256] = {
-   0x00000000,0x77073096,0xEE0E612C,0x990951BA,0x076DC419,0x706AF48F,0xE963A535,
-   0x9E6495A3,0x0EDB8832,0x79DCB8A4,0xE0D5E91E,0x97D2D988,0x09B64C2B,0x7EB17CBD,
-   0xE7B82D07,0x90BF1D91,0x1DB71064,0x6AB020F2,0xF3B97148,0x84BE41DE,0x1ADAD47D,
-   0x6DDDE4EB,0xF4D4B551,0x83D385C7,0x136C9856,0x646BA8C0,0xFD62F97A,0x8A65C9EC,
-   0x14015C4F,0x63066CD9,0xFA0F3D63,0x8D080DF5,0x3B6E20C8,0x4C69105E,0xD56041E4,
-   0xA2677172,0x3C03E4D1,0x4B04D447,0xD20D85FD,0xA50AB56B,0x35B5A8FA,0x42B2986C,
-   0xDBBBC9D6,0xACBCF940,0x32D86CE3,0x45DF5C75,0xDCD60DCF,0xABD13D59,0x26D930AC,
-   0x51DE003A,0xC8D75180,0xBFD06116,0x21B4F4B5,0x56B3C423,0xCFBA9599,0xB8BDA50F,
-   0x2802B89E,0x5F058808,0xC60CD9B2,0xB10BE924,0x2F6F7C87,0x58684C11,0xC1611DAB,
-   0xB6662D3D,0x76DC4190,0x01DB7106,0x98D220BC,0xEFD5102A,0x71B18589,0x06B6B51F,
-   0x9FBFE4A5,0xE8B8D433,0x7807C9A2,0x0F00F934,0x9609A88E,0xE10E9818,0x7F6A0DBB,
-   0x086D3D2D,0x91646C97,0xE6635C01,0x6B6B51F4,0x1C6C6162,0x856530D8,0xF262004E,
-   0x6C0695ED,0x1B01A57B,0x8208F4C1,0xF50FC457,0x65B0D9C6,0x12B7E950,0x8BBEB8EA,
-   0xFCB9887C,0x62DD1DDF,0x15DA2D49,0x8CD37CF3,0xFBD44C65,0x4DB26158,0x3AB551CE,
-   0xA3BC0074,0xD4BB30E2,0x4ADFA541,0x3DD895D7,0xA4D1C46D,0xD3D6F4FB,0x4369E96A,
-   0x346ED9FC,0xAD678846,0xDA60B8D0,0x44042D73,0x33031DE5,0xAA0A4C5F,0xDD0D7CC9,
-   0x5005713C,0x270241AA,0xBE0B1010,0xC90C2086,0x5768B525,0x206F85B3,0xB966D409,
-   0xCE61E49F,0x5EDEF90E,0x29D9C998,0xB0D09822,0xC7D7A8B4,0x59B33D17,0x2EB40D81,
-   0xB7BD5C3B,0xC0BA6CAD,0xEDB88320,0x9ABFB3B6,0x03B6E20C,0x74B1D29A,0xEAD54739,
-   0x9DD277AF,0x04DB2615,0x73DC1683,0xE3630B12,0x94643B84,0x0D6D6A3E,0x7A6A5AA8,
-   0xE40ECF0B,0x9309FF9D,0x0A00AE27,0x7D079EB1,0xF00F9344,0x8708A3D2,0x1E01F268,
-   0x6906C2FE,0xF762575D,0x806567CB,0x196C3671,0x6E6B06E7,0xFED41B76,0x89D32BE0,
-   0x10DA7A5A,0x67DD4ACC,0xF9B9DF6F,0x8EBEEFF9,0x17B7BE43,0x60B08ED5,0xD6D6A3E8,
-   0xA1D1937E,0x38D8C2C4,0x4FDFF252,0xD1BB67F1,0xA6BC5767,0x3FB506DD,0x48B2364B,
-   0xD80D2BDA,0xAF0A1B4C,0x36034AF6,0x41047A60,0xDF60EFC3,0xA867DF55,0x316E8EEF,
-   0x4669BE79,0xCB61B38C,0xBC66831A,0x256FD2A0,0x5268E236,0xCC0C7795,0xBB0B4703,
-   0x220216B9,0x5505262F,0xC5BA3BBE,0xB2BD0B28,0x2BB45A92,0x5CB36A04,0xC2D7FFA7,
-   0xB5D0CF31,0x2CD99E8B,0x5BDEAE1D,0x9B64C2B0,0xEC63F226,0x756AA39C,0x026D930A,
-   0x9C0906A9,0xEB0E363F,0x72076785,0x05005713,0x95BF4A82,0xE2B87A14,0x7BB12BAE,
-   0x0CB61B38,0x92D28E9B,0xE5D5BE0D,0x7CDCEFB7,0x0BDBDF21,0x86D3D2D4,0xF1D4E242,
-   0x68DDB3F8,0x1FDA836E,0x81BE16CD,0xF6B9265B,0x6FB077E1,0x18B74777,0x88085AE6,
-   0xFF0F6A70,0x66063BCA,0x11010B5C,0x8F659EFF,0xF862AE69,0x616BFFD3,0x166CCF45,
-   0xA00AE278,0xD70DD2EE,0x4E048354,0x3903B3C2,0xA7672661,0xD06016F7,0x4969474D,
-   0x3E6E77DB,0xAED16A4A,0xD9D65ADC,0x40DF0B66,0x37D83BF0,0xA9BCAE53,0xDEBB9EC5,
-   0x47B2CF7F,0x30B5FFE9,0xBDBDF21C,0xCABAC28A,0x53B39330,0x24B4A3A6,0xBAD03605,
-   0xCDD70693,0x54DE5729,0x23D967BF,0xB3667A2E,0xC4614AB8,0x5D681B02,0x2A6F2B94,
-   0xB40BBE37,0xC30C8EA1,0x5A05DF1B,0x2D02EF8D };
-    unsigned long crc32;
-    unsigned char *byteBuf;
-    size_t i;
+    uint32_t crc32;
 
     /** accumulate crc32 for buffer **/
-    crc32 = inCrc32 ^ 0xFFFFFFFF;
-    byteBuf = (unsigned char*) buf;
-    for (i=0; i < bufLen; i++) {
-        crc32 = (crc32 >> 8) ^ crcTable[ (crc32 ^ byteBuf[i]) & 0xFF ];
-    }
+    crc32 = (uint32_t)inCrc32 ^ 0xFFFFFFFF;
+    crc32 = __atomic_load_n(&crc32_kernel, __ATOMIC_ACQUIRE)(crc32, buf, bufLen);
     return( crc32 ^ 0xFFFFFFFF );
 }
 
+/* multiply a(x) by b(x) modulo P(x), in the bit-reflected representation */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+    return p;
+}
+
+/* x^(n * 2^k) mod P(x) */
+static uint32_t crc32_x2nmodp(unsigned long long n, unsigned int k)
+{
+    uint32_t p = (uint32_t)1 << 31; /* x^0 */
+
+    while (n) {
+        if (n & 1)
+            p = crc32_multmodp(crc32_x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/*----------------------------------------------------------------------------*\
+ *  NAME:
+ *     Crc32_Combine() - combines CRC-32 values of two adjacent buffers
+ *  DESCRIPTION:
+ *     Given the CRC-32 of a buffer A and the CRC-32 of a buffer B (both
+ *     computed with Crc32_ComputeBuf() starting from zero), computes the
+ *     CRC-32 of A followed by B, without access to the data.  This allows
+ *     computing the CRC of separate chunks in parallel and merging them in
+ *     order.  Takes O(log(lenB)) time.
+ *  ARGUMENTS:
+ *     crcA    - CRC-32 value of the first buffer
+ *     crcB    - CRC-32 value of the second buffer
+ *     lenB    - length of the second buffer, in bytes
+ *  RETURNS:
+ *     crc32 - CRC-32 value of the concatenation
+ *  ERRORS:
+ *     (no errors are possible)
+\*----------------------------------------------------------------------------*/
+
+unsigned long Crc32_Combine( unsigned long crcA, unsigned long crcB,
+                             unsigned long long lenB )
+{
+    /* shift A by lenB bytes (x^(8*lenB)), then add B */
+    return crc32_multmodp(crc32_x2nmodp(lenB, 3), (uint32_t)crcA) ^
+        (uint32_t)crcB;
+}
+
 /*----------------------------------------------------------------------------*\
  *  END OF MODULE: crc32.c
 \*----------------------------------------------------------------------------*/
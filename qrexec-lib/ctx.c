@@ -0,0 +1,488 @@
+/*
+ * Transfer contexts.  All the state of a transfer lives in a struct
+ * qfile_ctx; the traditional API works on a default one, which uses
+ * stdin/stdout and the current directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "ioall.h"
+#include "ctx.h"
+
+notify_progress_t *notify_progress_func = NULL;
+
+static struct qfile_ctx default_ctx;
+static pthread_once_t default_ctx_once = PTHREAD_ONCE_INIT;
+
+/*
+ * A driven transfer runs on its own stack, switched to by qfile_ctx_step()
+ * and back whenever it would block on the stream, so the pack and unpack
+ * code stays the same as for blocking operation.  The stack is only
+ * address space until used.
+ */
+#define DRIVER_STACK_SIZE (8 * 1024 * 1024)
+#define DRIVER_OUTBUF_SIZE (64 * 1024)
+
+struct qfile_driver {
+    ucontext_t caller;
+    ucontext_t engine;
+    char *stack;
+    int (*body)(struct qfile_ctx *ctx, void *data);
+    void *data;
+    /* started and not finished yet */
+    int running;
+    int failed;
+    int status;
+    /* the context is being freed */
+    int cancelled;
+    /* input of the current qfile_ctx_step() call */
+    const char *in;
+    size_t in_len, in_pos;
+    int in_eof;
+    int nonblock;
+    /* ctx->in_fd and ctx->out_fd, restored when the transfer ends */
+    int saved_in_fd, saved_out_fd;
+    char out[DRIVER_OUTBUF_SIZE];
+    size_t out_start, out_end;
+    char error[256];
+};
+
+/* the context being switched to, for driver_main() */
+static __thread struct qfile_ctx *entering_ctx;
+
+static void ctx_init(struct qfile_ctx *ctx)
+{
+    ctx->in_fd = 0;
+    ctx->out_fd = 1;
+    ctx->dirfd = AT_FDCWD;
+}
+
+static void default_ctx_init(void)
+{
+    ctx_init(&default_ctx);
+    default_ctx.pack = &default_pack_state;
+    default_ctx.unpack = &default_unpack_state;
+    pack_state_init(default_ctx.pack);
+    unpack_state_init(default_ctx.unpack);
+}
+
+struct qfile_ctx *qfile_default_ctx(void)
+{
+    pthread_once(&default_ctx_once, default_ctx_init);
+    return &default_ctx;
+}
+
+struct qfile_ctx *qfile_ctx_new(void)
+{
+    struct qfile_ctx *ctx = calloc(1, sizeof(*ctx));
+
+    if (!ctx)
+        return NULL;
+    ctx_init(ctx);
+    ctx->pack = pack_state_new();
+    ctx->unpack = unpack_state_new();
+    if (!ctx->pack || !ctx->unpack) {
+        qfile_ctx_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static void driver_switch_in(struct qfile_ctx *ctx)
+{
+    entering_ctx = ctx;
+    swapcontext(&ctx->driver->caller, &ctx->driver->engine);
+}
+
+static void driver_free(struct qfile_ctx *ctx)
+{
+    struct qfile_driver *d = ctx->driver;
+
+    /* an unfinished transfer is waiting for I/O; let it release what it holds */
+    d->cancelled = 1;
+    if (d->running)
+        driver_switch_in(ctx);
+    if (d->stack)
+        munmap(d->stack, DRIVER_STACK_SIZE);
+    free(d);
+    ctx->driver = NULL;
+}
+
+void qfile_ctx_free(struct qfile_ctx *ctx)
+{
+    if (!ctx || ctx == &default_ctx)
+        return;
+    if (ctx->driver)
+        driver_free(ctx);
+    if (ctx->pack)
+        pack_state_free(ctx->pack);
+    if (ctx->unpack)
+        unpack_state_free(ctx->unpack);
+    free(ctx);
+}
+
+void qfile_ctx_set_fds(struct qfile_ctx *ctx, int in_fd, int out_fd)
+{
+    ctx->in_fd = in_fd;
+    ctx->out_fd = out_fd;
+}
+
+void qfile_ctx_set_dirfd(struct qfile_ctx *ctx, int dirfd)
+{
+    ctx->dirfd = dirfd;
+}
+
+void qfile_ctx_set_progress(struct qfile_ctx *ctx, qfile_progress_t *func)
+{
+    ctx->progress = func;
+}
+
+void qfile_ctx_set_error_handler(struct qfile_ctx *ctx, qfile_error_handler_t *func)
+{
+    ctx->error_handler = func;
+}
+
+void qfile_ctx_set_user_data(struct qfile_ctx *ctx, void *data)
+{
+    ctx->user_data = data;
+}
+
+void *qfile_ctx_get_user_data(struct qfile_ctx *ctx)
+{
+    return ctx->user_data;
+}
+
+void qfile_notify_progress(struct qfile_ctx *ctx, int size, int flag)
+{
+    if (ctx->progress)
+        ctx->progress(ctx, size, flag);
+    else if (ctx == &default_ctx && notify_progress_func)
+        notify_progress_func(size, flag);
+}
+
+static int driven(struct qfile_ctx *ctx)
+{
+    return ctx->driver && ctx->driver->running;
+}
+
+/*
+ * On the transfer's stack: let the caller of qfile_ctx_step() continue.  If
+ * the context is freed meanwhile, end the transfer right away.
+ */
+static void driver_yield(struct qfile_ctx *ctx)
+{
+    swapcontext(&ctx->driver->engine, &ctx->driver->caller);
+    if (ctx->driver->cancelled)
+        qfile_exit(ctx, ECANCELED);
+}
+
+_Noreturn static void driver_finish(struct qfile_ctx *ctx, int failed, int status)
+{
+    struct qfile_driver *d = ctx->driver;
+
+    d->running = 0;
+    d->failed = failed;
+    d->status = status;
+    ctx->in_fd = d->saved_in_fd;
+    ctx->out_fd = d->saved_out_fd;
+    setcontext(&d->caller);
+    abort();
+}
+
+static void driver_main(void)
+{
+    struct qfile_ctx *ctx = entering_ctx;
+    int status = ctx->driver->body(ctx, ctx->driver->data);
+
+    driver_finish(ctx, status != 0, status);
+}
+
+_Noreturn void qfile_exit(struct qfile_ctx *ctx, int code)
+{
+    if (!driven(ctx))
+        exit(code);
+    pack_abort(ctx);
+    unpack_abort(ctx);
+    driver_finish(ctx, 1, code);
+}
+
+void qfile_set_error(struct qfile_ctx *ctx, const char *fmt, ...)
+{
+    va_list args;
+
+    if (!ctx->driver)
+        return;
+    va_start(args, fmt);
+    vsnprintf(ctx->driver->error, sizeof(ctx->driver->error), fmt, args);
+    va_end(args);
+}
+
+void qfile_report_error(struct qfile_ctx *ctx, const char *fmt, va_list args)
+{
+    if (driven(ctx)) {
+        va_list copy;
+
+        va_copy(copy, args);
+        vsnprintf(ctx->driver->error, sizeof(ctx->driver->error), fmt, copy);
+        va_end(copy);
+        if (ctx->error_handler)
+            ctx->error_handler(ctx, fmt, args);
+        return;
+    }
+    if (ctx->error_handler)
+        ctx->error_handler(ctx, fmt, args);
+    else if (ctx->legacy_error_handler)
+        ctx->legacy_error_handler(fmt, args);
+    else
+        vfprintf(stderr, fmt, args);
+}
+
+/* like read(), waiting for qfile_ctx_step() to provide the input */
+static ssize_t driver_read(struct qfile_ctx *ctx, void *buf, size_t size)
+{
+    struct qfile_driver *d = ctx->driver;
+    size_t len;
+
+    while (d->in_pos == d->in_len) {
+        if (d->in_eof)
+            return 0;
+        if (d->nonblock) {
+            errno = EAGAIN;
+            return -1;
+        }
+        driver_yield(ctx);
+    }
+    len = d->in_len - d->in_pos;
+    if (len > size)
+        len = size;
+    memcpy(buf, d->in + d->in_pos, len);
+    d->in_pos += len;
+    return len;
+}
+
+static int driver_write(struct qfile_ctx *ctx, const void *buf, size_t size)
+{
+    struct qfile_driver *d = ctx->driver;
+    size_t len;
+
+    while (size) {
+        if (d->out_end == sizeof(d->out)) {
+            driver_yield(ctx);
+            continue;
+        }
+        len = sizeof(d->out) - d->out_end;
+        if (len > size)
+            len = size;
+        memcpy(d->out + d->out_end, buf, len);
+        d->out_end += len;
+        buf = (const char *)buf + len;
+        size -= len;
+    }
+    return 1;
+}
+
+int qfile_read_all(struct qfile_ctx *ctx, int fd, void *buf, int size)
+{
+    struct qfile_driver *d = ctx->driver;
+    int got_read = 0, nonblock, ok = 1;
+    ssize_t ret;
+
+    if (!driven(ctx) || fd != ctx->in_fd)
+        return read_all(fd, buf, size);
+    nonblock = d->nonblock;
+    while (got_read < size) {
+        ret = driver_read(ctx, (char *)buf + got_read, size - got_read);
+        if (ret == 0)
+            errno = 0;
+        if (ret <= 0) {
+            ok = 0;
+            break;
+        }
+        /*
+         * Like read_all(), the rest is waited for - but only in this call,
+         * a driven transfer does not stay blocking after it.
+         */
+        d->nonblock = 0;
+        got_read += ret;
+    }
+    d->nonblock = nonblock;
+    return ok;
+}
+
+ssize_t qfile_read(struct qfile_ctx *ctx, int fd, void *buf, size_t size)
+{
+    if (!driven(ctx) || fd != ctx->in_fd)
+        return read(fd, buf, size);
+    return driver_read(ctx, buf, size);
+}
+
+int qfile_write_all(struct qfile_ctx *ctx, int fd, const void *buf, int size)
+{
+    if (!driven(ctx) || fd != ctx->out_fd)
+        return write_all(fd, buf, size);
+    return driver_write(ctx, buf, size);
+}
+
+void qfile_set_block(struct qfile_ctx *ctx, int fd)
+{
+    if (!driven(ctx) || fd != ctx->in_fd)
+        set_block(fd);
+    else
+        ctx->driver->nonblock = 0;
+}
+
+void qfile_set_nonblock(struct qfile_ctx *ctx, int fd)
+{
+    if (!driven(ctx) || fd != ctx->in_fd)
+        set_nonblock(fd);
+    else
+        ctx->driver->nonblock = 1;
+}
+
+static int driver_make_context(struct qfile_driver *d)
+{
+    if (getcontext(&d->engine))
+        return -1;
+    d->engine.uc_stack.ss_sp = d->stack;
+    d->engine.uc_stack.ss_size = DRIVER_STACK_SIZE;
+    d->engine.uc_link = NULL;
+    makecontext(&d->engine, driver_main, 0);
+    return 0;
+}
+
+int qfile_driver_start(struct qfile_ctx *ctx,
+                       int (*body)(struct qfile_ctx *ctx, void *data), void *data)
+{
+    struct qfile_driver *d = ctx->driver;
+
+    if (ctx == &default_ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (d && d->running) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!d) {
+        d = calloc(1, sizeof(*d));
+        if (!d)
+            return -1;
+        ctx->driver = d;
+    }
+    if (!d->stack) {
+        d->stack = mmap(NULL, DRIVER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                        -1, 0);
+        if (d->stack == MAP_FAILED) {
+            d->stack = NULL;
+            return -1;
+        }
+        /* guard page */
+        if (mprotect(d->stack, sysconf(_SC_PAGESIZE), PROT_NONE)) {
+            int saved_errno = errno;
+
+            munmap(d->stack, DRIVER_STACK_SIZE);
+            d->stack = NULL;
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    if (driver_make_context(d))
+        return -1;
+    d->body = body;
+    d->data = data;
+    d->running = 1;
+    d->failed = 0;
+    d->status = 0;
+    d->cancelled = 0;
+    d->in = NULL;
+    d->in_len = d->in_pos = 0;
+    d->in_eof = 0;
+    d->nonblock = 0;
+    d->out_start = d->out_end = 0;
+    d->error[0] = '\0';
+    /* the stream goes through qfile_ctx_step() instead, until the end */
+    d->saved_in_fd = ctx->in_fd;
+    d->saved_out_fd = ctx->out_fd;
+    ctx->in_fd = -1;
+    ctx->out_fd = -1;
+    return 0;
+}
+
+enum qfile_step qfile_ctx_step(struct qfile_ctx *ctx, const void *in, size_t in_len,
+                               size_t *consumed)
+{
+    struct qfile_driver *d = ctx->driver;
+
+    if (consumed)
+        *consumed = 0;
+    if (!d)
+        return QFILE_STEP_ERROR;
+    /* run only once the previous output is taken */
+    if (d->running && d->out_start == d->out_end) {
+        d->out_start = d->out_end = 0;
+        d->in = in;
+        d->in_len = in ? in_len : 0;
+        d->in_pos = 0;
+        if (!in)
+            d->in_eof = 1;
+        driver_switch_in(ctx);
+        if (consumed)
+            *consumed = d->in_pos;
+        d->in = NULL;
+        d->in_len = d->in_pos = 0;
+    }
+    if (d->out_start != d->out_end)
+        return QFILE_STEP_OUTPUT;
+    if (d->running)
+        return QFILE_STEP_NEED_INPUT;
+    return d->failed ? QFILE_STEP_ERROR : QFILE_STEP_DONE;
+}
+
+const void *qfile_ctx_output(struct qfile_ctx *ctx, size_t *len)
+{
+    struct qfile_driver *d = ctx->driver;
+
+    if (!d) {
+        *len = 0;
+        return NULL;
+    }
+    *len = d->out_end - d->out_start;
+    return d->out + d->out_start;
+}
+
+void qfile_ctx_output_consumed(struct qfile_ctx *ctx, size_t len)
+{
+    struct qfile_driver *d = ctx->driver;
+
+    if (len > d->out_end - d->out_start)
+        len = d->out_end - d->out_start;
+    d->out_start += len;
+}
+
+int qfile_ctx_status(struct qfile_ctx *ctx)
+{
+    return ctx->driver ? ctx->driver->status : 0;
+}
+
+const char *qfile_ctx_error_message(struct qfile_ctx *ctx)
+{
+    return ctx->driver ? ctx->driver->error : "";
+}
+
+void register_notify_progress(notify_progress_t *func)
+{
+    notify_progress_func = func;
+}
+
+void register_error_handler(error_handler_t *value)
+{
+    qfile_default_ctx()->legacy_error_handler = value;
+}
@@ -0,0 +1,78 @@
+#ifndef _CTX_H
+#define _CTX_H
+
+#include <sys/types.h>
+#include "libqubes-rpc-filecopy.h"
+
+struct pack_state;
+struct unpack_state;
+struct qfile_driver;
+
+struct qfile_ctx {
+    int in_fd;
+    int out_fd;
+    /* names are relative to it */
+    int dirfd;
+    qfile_progress_t *progress;
+    qfile_error_handler_t *error_handler;
+    /* register_error_handler(), default context only */
+    error_handler_t *legacy_error_handler;
+    void *user_data;
+    struct pack_state *pack;
+    struct unpack_state *unpack;
+    /* set up by the first qfile_ctx_start_*() */
+    struct qfile_driver *driver;
+};
+
+/* the context of the functions without a ctx argument */
+struct qfile_ctx *qfile_default_ctx(void);
+void qfile_notify_progress(struct qfile_ctx *ctx, int size, int flag);
+/* report an error with the context's handler (or on stderr) */
+void qfile_report_error(struct qfile_ctx *ctx, const char *fmt, va_list args);
+/*
+ * End the transfer: exit(code), or if the context is driven, return to the
+ * caller of qfile_ctx_step() with QFILE_STEP_ERROR.
+ */
+_Noreturn void qfile_exit(struct qfile_ctx *ctx, int code);
+/* the message for qfile_ctx_error_message() (driven contexts only) */
+void qfile_set_error(struct qfile_ctx *ctx, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Stream I/O.  Like read_all(), read(), write_all(), set_block() and
+ * set_nonblock(), except that on a driven context in_fd and out_fd refer
+ * to the buffers passed through qfile_ctx_step().
+ */
+int qfile_read_all(struct qfile_ctx *ctx, int fd, void *buf, int size);
+ssize_t qfile_read(struct qfile_ctx *ctx, int fd, void *buf, size_t size);
+int qfile_write_all(struct qfile_ctx *ctx, int fd, const void *buf, int size);
+void qfile_set_block(struct qfile_ctx *ctx, int fd);
+void qfile_set_nonblock(struct qfile_ctx *ctx, int fd);
+
+/* run body(ctx, data) as a driven transfer; returns -1 (with errno) on error */
+int qfile_driver_start(struct qfile_ctx *ctx,
+                       int (*body)(struct qfile_ctx *ctx, void *data), void *data);
+
+/* legacy callback, used by the default context */
+extern notify_progress_t *notify_progress_func;
+
+/* pack.c */
+extern struct pack_state default_pack_state;
+void pack_state_init(struct pack_state *ps);
+struct pack_state *pack_state_new(void);
+void pack_state_free(struct pack_state *ps);
+/* release what an aborted driven transfer left open */
+void pack_abort(struct qfile_ctx *ctx);
+
+/* unpack.c */
+extern struct unpack_state default_unpack_state;
+void unpack_state_init(struct unpack_state *us);
+struct unpack_state *unpack_state_new(void);
+void unpack_state_free(struct unpack_state *us);
+void unpack_abort(struct qfile_ctx *ctx);
+
+/* copy-file.c */
+int copy_file_ctx(struct qfile_ctx *ctx, int outfd, int infd, long long size,
+                  unsigned long *crc32);
+
+#endif /* _CTX_H */
@@ -50,6 +50,140 @@ struct result_header {
     uint64_t crc32;
 } __attribute__((packed));
 
+/*
+ * Protocol extensions.  A sender that knows the receiver supports them
+ * (e.g. from the qrexec service argument) offers a set of features in a
+ * QFILE_EXT_HELLO record, sent as the very first record.  The receiver
+ * replies with a result_header carrying the accepted subset in _pad
+ * (followed by an empty result_header_ext); older receivers reject the
+ * hello with EINVAL.  Extension records are file headers with file type
+ * QFILE_S_IFEXT, the record type in the permission bits, an empty name
+ * (namelen 1) and filelen bytes of payload.
+ */
+enum qfile_features {
+    /* regular files may be preceded by a QFILE_EXT_SPARSE extent map */
+    QFILE_FEATURE_SPARSE = (1 << 0),
+    /*
+     * directories are sent only once, before their contents; the receiver
+     * applies their mode and times at the end of the stream
+     */
+    QFILE_FEATURE_DIR_ONCE = (1 << 1),
+    /* regular files may be preceded by a QFILE_EXT_HARDLINK record */
+    QFILE_FEATURE_HARDLINK = (1 << 2),
+    /*
+     * regular files may be preceded by a QFILE_EXT_HASH record; after the
+     * file header the receiver replies with a result_header with _pad set to
+     * 1 if it already has the content (then no data follows), or 0
+     */
+    QFILE_FEATURE_HASH_SKIP = (1 << 3),
+    /*
+     * the hello reply is followed by a struct qfile_resume_point (and the
+     * name), and the sender continues after the entries listed there
+     */
+    QFILE_FEATURE_RESUME = (1 << 4),
+    /*
+     * regular files may be preceded by a QFILE_EXT_COMPRESS record; their
+     * data is then a sequence of blocks (struct qfile_block), compressed
+     * with the given codec
+     */
+    QFILE_FEATURE_ZSTD = (1 << 5),
+    QFILE_FEATURE_LZ4 = (1 << 6),
+    /*
+     * regular files may be preceded by a QFILE_EXT_STRIPE record; their data
+     * is then sent on the data channels instead of the stream.  The hello
+     * reply is followed by a struct qfile_ext_stripe with the number of
+     * channels the receiver reads (before the resume point, if any), and
+     * the sender uses at most that many.
+     */
+    QFILE_FEATURE_STRIPE = (1 << 7),
+};
+
+#define QFILE_S_IFEXT 0170000
+
+enum qfile_ext_record {
+    QFILE_EXT_HELLO = 1,        /* payload: struct qfile_ext_hello */
+    QFILE_EXT_SPARSE = 2,       /* payload: array of struct qfile_extent */
+    /*
+     * payload: NUL-terminated name of a regular file sent earlier; the
+     * following (empty) regular file is created as a hard link to it
+     */
+    QFILE_EXT_HARDLINK = 3,
+    QFILE_EXT_HASH = 4,         /* payload: struct qfile_ext_hash */
+    QFILE_EXT_COMPRESS = 5,     /* payload: struct qfile_ext_compress */
+    QFILE_EXT_STRIPE = 6,       /* payload: struct qfile_ext_stripe */
+};
+
+struct qfile_ext_hello {
+    uint32_t features;
+    uint32_t _pad;
+};
+
+/*
+ * Data extent of the next regular file, sorted by offset.  The file data
+ * that follows its header consists of these extents only, the rest of the
+ * file (up to filelen) is a hole.
+ */
+struct qfile_extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct qfile_ext_hash {
+    uint64_t size;
+    uint8_t sha256[32];
+};
+
+enum qfile_codec {
+    QFILE_CODEC_ZSTD = 1,
+    QFILE_CODEC_LZ4 = 2,
+};
+
+struct qfile_ext_compress {
+    uint32_t codec;
+    uint32_t _pad;
+};
+
+/*
+ * Header of a block of compressed file data, each compressed separately.
+ * All blocks but the last one have QFILE_BLOCK_SIZE raw bytes; a block with
+ * stored_len == raw_len is not compressed.
+ */
+struct qfile_block {
+    uint32_t raw_len;
+    uint32_t stored_len;
+};
+
+#define QFILE_BLOCK_SIZE (256 * 1024)
+
+/*
+ * Striped file data: the file is split into QFILE_STRIPE_CHUNK_SIZE chunks
+ * and chunk i is sent on data channel i % channels, as a struct
+ * qfile_stripe_frame followed by the data.  Frames are numbered on each
+ * channel separately, from 0 at the start of the transfer.
+ */
+struct qfile_ext_stripe {
+    uint32_t channels;
+    uint32_t _pad;
+};
+
+struct qfile_stripe_frame {
+    uint64_t seq;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t crc32;     /* of the data */
+};
+
+#define QFILE_STRIPE_CHUNK_SIZE (1024 * 1024)
+#define QFILE_MAX_CHANNELS 16
+
+struct qfile_resume_point {
+    uint64_t entries;   /* file headers already processed completely */
+    uint32_t crc32;     /* stream checksum right after them */
+    uint32_t namelen;   /* length of the name of the last one (following) */
+};
+
+#define QFILE_MAX_EXTENTS 16384
+
 /* optional info about last processed file */
 struct result_header_ext {
     uint32_t last_namelen;
@@ -88,6 +222,8 @@ void set_verbose(int value);
  * for this file, plus a given margin.
  */
 void set_wait_for_space(unsigned long margin);
+/* give up waiting for space with ENOSPC after this many seconds (0 - never) */
+void set_wait_for_space_timeout(unsigned int seconds);
 /* register open fd to /proc/PID/fd of this process */
 void set_procfs_fd(int value);
 int write_all(int fd, const void *buf, int size);
@@ -96,11 +232,67 @@ int copy_fd_all(int fdout, int fdin);
 void set_nonblock(int fd);
 void set_block(int fd);
 
-/* unpacking */
+/* checksum */
+enum crc32_impl {
+    CRC32_IMPL_AUTO,
+    CRC32_IMPL_BYTEWISE,
+    CRC32_IMPL_SLICE8,
+    CRC32_IMPL_SLICE16,
+    CRC32_IMPL_PCLMUL,  /* x86-64 with PCLMULQDQ and SSE4.1 */
+    CRC32_IMPL_ARMV8,   /* AArch64 with CRC32 extension */
+};
 extern unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
         size_t bufLen );
+/* CRC-32 of A followed by B, given CRCs of A and B and the length of B */
+unsigned long Crc32_Combine( unsigned long crcA, unsigned long crcB,
+        unsigned long long lenB );
+/* select CRC-32 kernel (all produce the same result); -1 if not available */
+int Crc32_SetImplementation(enum crc32_impl impl);
+const char *Crc32_ImplementationName(void);
+
+/* unpacking */
 extern int do_unpack(void);
 extern int do_unpack_ext(int flags);
+/*
+ * Create and write small files on this many threads (default 1 - all work
+ * is done by the calling thread).
+ */
+void set_unpack_threads(int value);
+/*
+ * Start writeback of each file while receiving and at the end wait only
+ * for the received files, instead of syncfs() on the whole filesystem.
+ */
+void set_incremental_sync(int value);
+/*
+ * Cache of files named by the hex SHA-256 of their content, used to satisfy
+ * QFILE_FEATURE_HASH_SKIP (offered only if set); received files with a
+ * matching hash are copied (or reflinked) into it.  The cache is the
+ * subdirectory source_qube of dirfd, created if needed, and holds only
+ * what that qube sent: the reply to each hash tells the sender whether the
+ * content is cached, so a cache must never be shared between source qubes.
+ * dirfd stays owned by the caller, and -1 disables the cache.  The caller
+ * manages its size.  Returns -1 (with errno) on error.
+ */
+int set_unpack_hash_cache(int dirfd, const char *source_qube);
+/*
+ * Record completed entries in this file (opened read-write), to let a
+ * sender offering QFILE_FEATURE_RESUME (offered only if set) continue an
+ * interrupted transfer into the same directory.  Emptied when a transfer
+ * is not resumed, and after a successful one.  Disables set_unpack_threads().
+ */
+void set_unpack_journal(int fd);
+/*
+ * Protocol extensions to accept if offered by the sender (default: none;
+ * the hello is still answered, with no features).
+ */
+void set_unpack_features(uint32_t features);
+/*
+ * Data channels (besides the stream) to receive striped files on, each
+ * served by a thread of its own; QFILE_FEATURE_STRIPE is accepted only if
+ * set, and the threads could be started.  The fds stay owned by the caller;
+ * a channel that got an invalid frame is shut down.
+ */
+void set_unpack_channels(const int *fds, unsigned int count);
 
 /* packing */
 int single_file_processor(const char *filename, const struct stat *st);
@@ -110,9 +302,158 @@ void write_headers(const struct file_header *hdr, const char *filename);
 int copy_file_with_crc(int outfd, int infd, long long size);
 /* MUST be called before first do_fs_walk/single_file_processor */
 void qfile_pack_init(void);
+/*
+ * Offer protocol extensions (QFILE_FEATURE_*) to the receiver, returns the
+ * accepted ones.  Must be called right after qfile_pack_init(), and only if
+ * the receiver is known to understand the offer.
+ */
+uint32_t qfile_pack_negotiate(uint32_t features);
 void set_ignore_quota_error(int value);
+/*
+ * Prefetch stat data of directory entries on this many helper threads in
+ * do_fs_walk() (default 0 - none).
+ */
+void set_pack_prefetch_threads(unsigned int value);
+/*
+ * Stat the next entries (up to 64) of a directory and start read-ahead of
+ * the regular ones while sending the current file (default 0 - disabled).
+ */
+void set_pack_lookahead(unsigned int entries);
+/*
+ * Order of entries within each directory in do_fs_walk(); sorting needs the
+ * whole directory in memory.  Parents are always sent before their contents.
+ */
+enum qfile_pack_order {
+    QFILE_PACK_ORDER_READDIR,   /* as returned by the filesystem (default) */
+    QFILE_PACK_ORDER_INODE,     /* by inode number */
+    QFILE_PACK_ORDER_PHYSICAL,  /* by disk address of the first extent (FIEMAP),
+                                   small files first, by inode number */
+};
+void set_pack_order(enum qfile_pack_order order);
+/*
+ * Collect small writes (headers, names, small files) and send them in
+ * batches of at most max_bytes.  A batch is sent when data is added more
+ * than max_delay_ms after its first byte, and before reading a directory
+ * or waiting for the receiver; there is no timer.  max_bytes = 0 disables
+ * batching.
+ */
+void set_pack_batching(unsigned long max_bytes, unsigned int max_delay_ms);
+/*
+ * Check for an early error from the receiver only after this many files or
+ * this many bytes of file data (0 - no limit, both 0 - only at the end).
+ * The default is after every file. A failing receiver is still detected on
+ * the next write, and the error always carries the name reported by it.
+ */
+void set_result_check_interval(unsigned int files, unsigned long long bytes);
+/*
+ * Send the data of big regular files over these data channels (at most
+ * QFILE_MAX_CHANNELS, each served by a thread of its own), if the receiver
+ * accepted QFILE_FEATURE_STRIPE (offered only if set).  The fds stay owned
+ * by the caller; they are shut down if the receiver reports an error while
+ * a file is sent over them.
+ */
+void set_pack_channels(const int *fds, unsigned int count);
 /* those two will call registered error handler if needed */
 void wait_for_result(void);
 void notify_end_and_wait_for_result(void);
 
+/*
+ * Transfer contexts.  A context holds all the state of a transfer, so that
+ * several transfers can run at the same time in one process, each on its
+ * own thread (a context must be used by one thread at a time).  The
+ * functions above work on a default context, which reads the stream from
+ * stdin, writes to stdout and resolves names in the current directory; the
+ * qfile_ctx_* functions below are their counterparts.  Errors still end the
+ * process, after calling the error handler.
+ */
+struct qfile_ctx;
+typedef void (qfile_progress_t)(struct qfile_ctx *ctx, int size, int flag);
+typedef void (qfile_error_handler_t)(struct qfile_ctx *ctx, const char *fmt, va_list args);
+/* returns NULL if out of memory */
+struct qfile_ctx *qfile_ctx_new(void);
+void qfile_ctx_free(struct qfile_ctx *ctx);
+/* the stream is read from in_fd and written to out_fd (default 0 and 1) */
+void qfile_ctx_set_fds(struct qfile_ctx *ctx, int in_fd, int out_fd);
+/* names are relative to this directory (default AT_FDCWD) */
+void qfile_ctx_set_dirfd(struct qfile_ctx *ctx, int dirfd);
+void qfile_ctx_set_progress(struct qfile_ctx *ctx, qfile_progress_t *func);
+void qfile_ctx_set_error_handler(struct qfile_ctx *ctx, qfile_error_handler_t *func);
+void qfile_ctx_set_user_data(struct qfile_ctx *ctx, void *data);
+void *qfile_ctx_get_user_data(struct qfile_ctx *ctx);
+
+int qfile_ctx_unpack(struct qfile_ctx *ctx, int flags);
+void qfile_ctx_set_size_limit(struct qfile_ctx *ctx, unsigned long long new_bytes_limit,
+                              unsigned long long new_files_limit);
+void qfile_ctx_set_verbose(struct qfile_ctx *ctx, int value);
+void qfile_ctx_set_wait_for_space(struct qfile_ctx *ctx, unsigned long margin);
+void qfile_ctx_set_wait_for_space_timeout(struct qfile_ctx *ctx, unsigned int seconds);
+void qfile_ctx_set_procfs_fd(struct qfile_ctx *ctx, int value);
+void qfile_ctx_set_unpack_threads(struct qfile_ctx *ctx, int value);
+void qfile_ctx_set_incremental_sync(struct qfile_ctx *ctx, int value);
+int qfile_ctx_set_unpack_hash_cache(struct qfile_ctx *ctx, int dirfd, const char *source_qube);
+void qfile_ctx_set_unpack_journal(struct qfile_ctx *ctx, int fd);
+void qfile_ctx_set_unpack_features(struct qfile_ctx *ctx, uint32_t features);
+void qfile_ctx_set_unpack_channels(struct qfile_ctx *ctx, const int *fds, unsigned int count);
+
+void qfile_ctx_pack_init(struct qfile_ctx *ctx);
+uint32_t qfile_ctx_pack_negotiate(struct qfile_ctx *ctx, uint32_t features);
+int qfile_ctx_pack_file(struct qfile_ctx *ctx, const char *filename, const struct stat *st);
+int qfile_ctx_pack_walk(struct qfile_ctx *ctx, const char *file, int ignore_symlinks);
+void qfile_ctx_write_headers(struct qfile_ctx *ctx, const struct file_header *hdr,
+                             const char *filename);
+int qfile_ctx_copy_file_with_crc(struct qfile_ctx *ctx, int outfd, int infd, long long size);
+void qfile_ctx_set_ignore_quota_error(struct qfile_ctx *ctx, int value);
+void qfile_ctx_set_pack_prefetch_threads(struct qfile_ctx *ctx, unsigned int value);
+void qfile_ctx_set_pack_lookahead(struct qfile_ctx *ctx, unsigned int entries);
+void qfile_ctx_set_pack_order(struct qfile_ctx *ctx, enum qfile_pack_order order);
+void qfile_ctx_set_pack_batching(struct qfile_ctx *ctx, unsigned long max_bytes,
+                                 unsigned int max_delay_ms);
+void qfile_ctx_set_pack_channels(struct qfile_ctx *ctx, const int *fds, unsigned int count);
+void qfile_ctx_set_result_check_interval(struct qfile_ctx *ctx, unsigned int files,
+                                         unsigned long long bytes);
+void qfile_ctx_wait_for_result(struct qfile_ctx *ctx);
+void qfile_ctx_notify_end_and_wait_for_result(struct qfile_ctx *ctx);
+
+/*
+ * Driven (non-blocking) operation, for event loops.  A transfer started
+ * with qfile_ctx_start_unpack() or qfile_ctx_start_pack() does no I/O on
+ * the stream fds; instead the caller moves the stream data with
+ * qfile_ctx_step(), which feeds in the received bytes (in == NULL at the
+ * end of input) and runs the transfer until:
+ *  - QFILE_STEP_NEED_INPUT: all the input was consumed, call again when
+ *    more arrives,
+ *  - QFILE_STEP_OUTPUT: qfile_ctx_output() has data to send; the transfer
+ *    continues only after all of it was taken with
+ *    qfile_ctx_output_consumed().  *consumed tells how much of the input
+ *    was used, the rest must be passed again,
+ *  - QFILE_STEP_DONE or QFILE_STEP_ERROR: the transfer is finished.
+ * Errors end the transfer instead of the process; qfile_ctx_status() is
+ * then the exit code a blocking transfer would have ended with (for unpack,
+ * the error sent to the other side), and qfile_ctx_error_message() says
+ * what happened.  The transfer runs on a stack of its own, so it must be
+ * stepped from one thread only; file system operations (and waiting for
+ * disk space) still block, and so do data channels, which are used
+ * directly.  The stack takes 8 MiB of address space for each context that
+ * was ever driven, until it is freed (only the pages touched use memory).
+ * The fds set with qfile_ctx_set_fds() are kept for later blocking use.
+ * Freeing the context aborts an unfinished transfer.
+ */
+enum qfile_step {
+    QFILE_STEP_NEED_INPUT,
+    QFILE_STEP_OUTPUT,
+    QFILE_STEP_DONE,
+    QFILE_STEP_ERROR,
+};
+/* the sending side: qfile_ctx_pack_init() ... notify_end_and_wait_for_result() */
+typedef int (qfile_pack_func_t)(struct qfile_ctx *ctx, void *data);
+/* both return -1 (with errno set) if the transfer could not be started */
+int qfile_ctx_start_unpack(struct qfile_ctx *ctx, int flags);
+int qfile_ctx_start_pack(struct qfile_ctx *ctx, qfile_pack_func_t *func, void *data);
+enum qfile_step qfile_ctx_step(struct qfile_ctx *ctx, const void *in, size_t in_len,
+                               size_t *consumed);
+const void *qfile_ctx_output(struct qfile_ctx *ctx, size_t *len);
+void qfile_ctx_output_consumed(struct qfile_ctx *ctx, size_t len);
+int qfile_ctx_status(struct qfile_ctx *ctx);
+const char *qfile_ctx_error_message(struct qfile_ctx *ctx);
+
 #endif /* _LIBQUBES_RPC_FILECOPY_H */
@@ -8,48 +8,322 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include "libqubes-rpc-filecopy.h"
+#include "sha256.h"
+#include "compress.h"
+#include "stripe.h"
+#include "ctx.h"
 
-static unsigned long crc32_sum;
-static int ignore_quota_error = 0;
-error_handler_t *error_handler = NULL;
+/*
+ * Output buffer: headers, names, symlink targets and small files are
+ * collected here and sent with a single write().  It is flushed when full,
+ * when data is added and the oldest byte in it is too old, before reading
+ * a directory, and before waiting for the receiver.  There is no timer, so
+ * a single stat() or open() that stalls can still delay the data by more
+ * than the configured delay.
+ */
+#define OUTBUF_SIZE (256 * 1024)
+#define OUTBUF_DEFAULT_DELAY_MS 10
+/* bigger files are sent directly from the file with copy_file() */
+#define OUTBUF_MAX_FILE_SIZE (64 * 1024)
 
-void register_error_handler(error_handler_t *value) {
-    error_handler = value;
+/*
+ * Optional stat prefetch: after each getdents64() batch, the entries are
+ * queued for helper threads, which fstatat() them so that the inodes are
+ * already cached when the main thread gets to them.  The queue only holds
+ * hints - when it is full, entries are simply not prefetched.
+ */
+#define PREFETCH_QUEUE_SIZE 256
+#define MAX_PREFETCH_THREADS 16
+
+struct prefetch_job {
+    int dirfd;
+    char name[NAME_MAX + 1];
+};
+
+struct prefetch {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t idle;
+    pthread_t threads[MAX_PREFETCH_THREADS];
+    unsigned int nthreads;
+    int stop;
+    /* jobs being processed, their dirfd must stay open */
+    unsigned int running;
+    unsigned long head, tail;
+    struct prefetch_job jobs[PREFETCH_QUEUE_SIZE];
+};
+
+/*
+ * Regular files with more than one link sent so far (with
+ * QFILE_FEATURE_HARDLINK), an open addressing hash table by (st_dev, st_ino);
+ * the names are kept in one buffer.
+ */
+struct sent_inode {
+    dev_t dev;
+    ino_t ino;
+    size_t name_offset;
+};
+
+struct walk_level;
+
+/* everything about the sending side of a transfer */
+struct pack_state {
+    unsigned long crc32_sum;
+    int ignore_quota_error;
+    /* protocol extensions accepted by the receiver */
+    uint32_t pack_features;
+    struct qfile_extent extents[QFILE_MAX_EXTENTS];
+    /* entries to skip, as the receiver has them from an interrupted transfer */
+    unsigned long long resume_skip;
+    unsigned long resume_crc;
+    char resume_name[MAX_PATH_LENGTH + 1];
+    /*
+     * Compression codec in use (0 if none) and its level, adjusted between
+     * blocks: down while compressing takes longer than writing, up while the
+     * output is the bottleneck.
+     */
+    enum qfile_codec pack_codec;
+    int compress_level, compress_level_min, compress_level_max;
+    long long compress_ns, compress_write_ns;
+    unsigned int compress_blocks;
+    char compress_in[QFILE_BLOCK_SIZE];
+    char compress_out[QFILE_BLOCK_SIZE];
+    struct compress_state compress;
+    /* data channels for QFILE_FEATURE_STRIPE, and how many of them are used */
+    struct stripe stripe;
+    unsigned int stripe_channels;
+    struct sent_inode *sent_inodes;
+    size_t sent_inodes_size, sent_inodes_count;
+    char *sent_names;
+    size_t sent_names_len, sent_names_size;
+
+    char outbuf[OUTBUF_SIZE];
+    size_t outbuf_len;
+    size_t outbuf_limit;
+    unsigned int outbuf_max_delay_ms;
+    struct timespec outbuf_first_time;
+
+    /*
+     * How often to check for an early error from the receiver: after this
+     * many files, or this many bytes of file data, whichever comes first (0 -
+     * no limit).  By default after every file.
+     */
+    unsigned int result_check_files;
+    unsigned long long result_check_bytes;
+    unsigned int files_since_check;
+    unsigned long long bytes_since_check;
+
+    unsigned int opt_prefetch_threads;
+    struct prefetch prefetch;
+    unsigned int opt_lookahead;
+    enum qfile_pack_order opt_pack_order;
+    /* statx() is not available */
+    int no_statx;
+    /* path of the entry being sent by the walker */
+    char walk_path[MAX_PATH_LENGTH];
+    /* the directories being walked, innermost first */
+    struct walk_level *walk_top;
+    /* the file being sent, if open */
+    int file_fd;
+};
+
+struct pack_state default_pack_state;
+
+void pack_state_init(struct pack_state *ps)
+{
+    ps->outbuf_limit = OUTBUF_SIZE;
+    ps->outbuf_max_delay_ms = OUTBUF_DEFAULT_DELAY_MS;
+    ps->result_check_files = 1;
+    ps->opt_pack_order = QFILE_PACK_ORDER_READDIR;
+    ps->file_fd = -1;
+    pthread_mutex_init(&ps->prefetch.lock, NULL);
+    pthread_cond_init(&ps->prefetch.queued, NULL);
+    pthread_cond_init(&ps->prefetch.idle, NULL);
+    stripe_init(&ps->stripe);
 }
 
-_Noreturn static void call_error_handler(const char *fmt, ...)
+struct pack_state *pack_state_new(void)
+{
+    struct pack_state *ps = calloc(1, sizeof(*ps));
+
+    if (ps)
+        pack_state_init(ps);
+    return ps;
+}
+
+void pack_state_free(struct pack_state *ps)
+{
+    pthread_mutex_destroy(&ps->prefetch.lock);
+    pthread_cond_destroy(&ps->prefetch.queued);
+    pthread_cond_destroy(&ps->prefetch.idle);
+    stripe_destroy(&ps->stripe);
+    compress_state_free(&ps->compress);
+    free(ps->sent_inodes);
+    free(ps->sent_names);
+    free(ps);
+}
+
+_Noreturn static void call_error_handler(struct qfile_ctx *ctx, const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    if (error_handler) {
-        error_handler(fmt, args);
-    } else {
-        vfprintf(stderr, fmt, args);
-    }
+    qfile_report_error(ctx, fmt, args);
     va_end(args);
-    exit(1);
+    qfile_exit(ctx, 1);
 }
 
-static int write_all_with_crc(int fd, const void *buf, int size)
+/* the receiver stopped without reporting an error (hopefully it produced a message) */
+_Noreturn static void receiver_gone(struct qfile_ctx *ctx)
 {
-    crc32_sum = Crc32_ComputeBuf(crc32_sum, buf, size);
-    return write_all(fd, buf, size);
+    qfile_set_error(ctx, "File copy: connection to the receiver lost");
+    qfile_exit(ctx, 1);
 }
 
-void notify_end_and_wait_for_result(void)
+void qfile_ctx_set_pack_batching(struct qfile_ctx *ctx, unsigned long max_bytes, unsigned int max_delay_ms)
+{
+    struct pack_state *ps = ctx->pack;
+
+    if (max_bytes > OUTBUF_SIZE)
+        max_bytes = OUTBUF_SIZE;
+    ps->outbuf_limit = max_bytes;
+    ps->outbuf_max_delay_ms = max_delay_ms;
+}
+
+static int flush_outbuf(struct qfile_ctx *ctx)
+{
+    struct pack_state *ps = ctx->pack;
+    int ret = 1;
+
+    if (ps->outbuf_len)
+        ret = qfile_write_all(ctx, ctx->out_fd, ps->outbuf, ps->outbuf_len);
+    ps->outbuf_len = 0;
+    return ret;
+}
+
+static int outbuf_too_old(struct qfile_ctx *ctx)
+{
+    struct pack_state *ps = ctx->pack;
+    struct timespec now;
+    long long delay_ms;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    delay_ms = (now.tv_sec - ps->outbuf_first_time.tv_sec) * 1000LL +
+        (now.tv_nsec - ps->outbuf_first_time.tv_nsec) / 1000000;
+    return delay_ms >= ps->outbuf_max_delay_ms;
+}
+
+/*
+ * Make room for size bytes. Returns 0 if they don't fit in the buffer at
+ * all, in which case the buffer is flushed, so the data can be written
+ * directly.
+ */
+static int outbuf_reserve(struct qfile_ctx *ctx, size_t size, int *write_error)
+{
+    struct pack_state *ps = ctx->pack;
+
+    *write_error = 0;
+    if (size > ps->outbuf_limit || ps->outbuf_len + size > ps->outbuf_limit) {
+        if (!flush_outbuf(ctx)) {
+            *write_error = 1;
+            return 0;
+        }
+        if (size > ps->outbuf_limit)
+            return 0;
+    }
+    if (!ps->outbuf_len)
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ps->outbuf_first_time);
+    return 1;
+}
+
+/* called after adding data to the buffer */
+static int outbuf_maybe_flush(struct qfile_ctx *ctx)
+{
+    struct pack_state *ps = ctx->pack;
+
+    if (ps->outbuf_len >= ps->outbuf_limit || outbuf_too_old(ctx))
+        return flush_outbuf(ctx);
+    return 1;
+}
+
+static int write_all_with_crc(struct qfile_ctx *ctx, int fd, const void *buf, int size)
+{
+    struct pack_state *ps = ctx->pack;
+    int write_error;
+
+    ps->crc32_sum = Crc32_ComputeBuf(ps->crc32_sum, buf, size);
+    if (fd != ctx->out_fd || !outbuf_reserve(ctx, size, &write_error)) {
+        if (write_error)
+            return 0;
+        return qfile_write_all(ctx, fd, buf, size);
+    }
+    memcpy(ps->outbuf + ps->outbuf_len, buf, size);
+    ps->outbuf_len += size;
+    return outbuf_maybe_flush(ctx);
+}
+
+/*
+ * Read a whole (small) file directly into the output buffer. Returns -1 if
+ * it doesn't fit, a COPY_FILE_* status otherwise.
+ */
+static int buffer_file_contents(struct qfile_ctx *ctx, int fd, long long size)
 {
+    struct pack_state *ps = ctx->pack;
+    int write_error;
+    char *start;
+    long long got = 0;
+    ssize_t ret;
+
+    if (size > OUTBUF_MAX_FILE_SIZE)
+        return -1;
+    if (!outbuf_reserve(ctx, size, &write_error))
+        return write_error ? COPY_FILE_WRITE_ERROR : -1;
+    start = ps->outbuf + ps->outbuf_len;
+    while (got < size) {
+        ret = read(fd, start + got, size - got);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (!ret)
+            return COPY_FILE_READ_EOF;
+        if (ret < 0)
+            return COPY_FILE_READ_ERROR;
+        got += ret;
+    }
+    ps->crc32_sum = Crc32_ComputeBuf(ps->crc32_sum, start, size);
+    ps->outbuf_len += size;
+    if (size)
+        qfile_notify_progress(ctx, size, 0);
+    return outbuf_maybe_flush(ctx) ? COPY_FILE_OK : COPY_FILE_WRITE_ERROR;
+}
+
+void qfile_ctx_notify_end_and_wait_for_result(struct qfile_ctx *ctx)
+{
+    struct pack_state *ps = ctx->pack;
     struct file_header end_hdr;
 
+    if (ps->resume_skip)
+        call_error_handler(ctx, "Cannot resume the transfer, files have changed (\"%s\" not found)",
+                ps->resume_name);
     /* notify end of transfer */
     memset(&end_hdr, 0, sizeof(end_hdr));
     end_hdr.namelen = 0;
     end_hdr.filelen = 0;
-    write_all_with_crc(1, &end_hdr, sizeof(end_hdr));
+    write_all_with_crc(ctx, ctx->out_fd, &end_hdr, sizeof(end_hdr));
+    flush_outbuf(ctx);
+    stripe_stop(&ps->stripe);
 
-    set_block(0);
-    wait_for_result();
+    qfile_set_block(ctx, ctx->in_fd);
+    qfile_ctx_wait_for_result(ctx);
 }
 
 static void sanitize_remote_filename(char *untrusted_filename)
@@ -62,23 +336,16 @@ static void sanitize_remote_filename(char *untrusted_filename)
     }
 }
 
-void wait_for_result(void)
+/* process a result whose header was already read */
+static void handle_result(struct qfile_ctx *ctx, const struct result_header *result_hdr)
 {
-    struct result_header hdr;
+    struct pack_state *ps = ctx->pack;
+    struct result_header hdr = *result_hdr;
     struct result_header_ext hdr_ext;
     char last_filename[MAX_PATH_LENGTH + 1];
     char last_filename_prefix[] = "; Last file: ";
 
-    if (!read_all(0, &hdr, sizeof(hdr))) {
-        if (errno == EAGAIN) {
-            // no result sent and stdin still open
-            return;
-        } else {
-            // other read error or EOF
-            exit(1);  // hopefully remote has produced error message
-        }
-    }
-    if (!read_all(0, &hdr_ext, sizeof(hdr_ext))) {
+    if (!qfile_read_all(ctx, ctx->in_fd, &hdr_ext, sizeof(hdr_ext))) {
         // remote used old result_header struct
         hdr_ext.last_namelen = 0;
     }
@@ -86,7 +353,7 @@ void wait_for_result(void)
         // read only at most MAX_PATH_LENGTH chars
         hdr_ext.last_namelen = MAX_PATH_LENGTH;
     }
-    if (!read_all(0, last_filename, hdr_ext.last_namelen)) {
+    if (!qfile_read_all(ctx, ctx->in_fd, last_filename, hdr_ext.last_namelen)) {
         fprintf(stderr, "Failed to get last filename\n");
         hdr_ext.last_namelen = 0;
     }
@@ -102,57 +369,498 @@ void wait_for_result(void)
     if (hdr.error_code != 0) {
         switch (hdr.error_code) {
             case EEXIST:
-                call_error_handler("A file named \"%s\" already exists in QubesIncoming dir", last_filename);
+                call_error_handler(ctx, "A file named \"%s\" already exists in QubesIncoming dir", last_filename);
                 break;
             case EINVAL:
-                call_error_handler("File copy: Corrupted data from packer%s\"%s\"", last_filename_prefix, last_filename);
+                call_error_handler(ctx, "File copy: Corrupted data from packer%s\"%s\"", last_filename_prefix, last_filename);
                 break;
             case EILSEQ:
-                call_error_handler("Forbidden character in file or link target. Name might look somewhat like \"%s\"", last_filename);
+                call_error_handler(ctx, "Forbidden character in file or link target. Name might look somewhat like \"%s\"", last_filename);
                 break;
             case ENOLINK:
                 // FIXME: the protocol only provides the name of the file, not what it points to.
                 // FIXME: This assumes that a symlink target was rejected, not a path.  However,
                 // this code should only produces valid paths, so if an invalid path gets sent,
                 // that's a bug.
-                call_error_handler("Cannot verify that link at \"%s\" would not be broken by copy", last_filename);
+                call_error_handler(ctx, "Cannot verify that link at \"%s\" would not be broken by copy", last_filename);
                 break;
             case EDQUOT:
-                if (ignore_quota_error) {
+                if (ps->ignore_quota_error) {
                     /* skip also CRC check as sender and receiver might be
                      * desynchronized in this case */
                     return;
                 }
 		/* fallthrough */
             default:
-                call_error_handler("File copy: \"%s%s%s\"",
+                call_error_handler(ctx, "File copy: \"%s%s%s\"",
                         strerror(hdr.error_code), last_filename_prefix, last_filename);
         }
     }
-    if (hdr.crc32 != crc32_sum) {
-        call_error_handler("File transfer failed: checksum mismatch");
+    if (hdr.crc32 != ps->crc32_sum) {
+        call_error_handler(ctx, "File transfer failed: checksum mismatch");
     }
 }
 
-void write_headers(const struct file_header *hdr, const char *filename)
+void qfile_ctx_wait_for_result(struct qfile_ctx *ctx)
 {
-    if (!write_all_with_crc(1, hdr, sizeof(*hdr))
-            || !write_all_with_crc(1, filename, hdr->namelen)) {
-        set_block(0);
-        wait_for_result();
-        exit(1);
+    struct result_header hdr;
+
+    if (!qfile_read_all(ctx, ctx->in_fd, &hdr, sizeof(hdr))) {
+        if (errno == EAGAIN) {
+            // no result sent and stdin still open
+            return;
+        } else {
+            // other read error or EOF
+            receiver_gone(ctx);
+        }
     }
+    handle_result(ctx, &hdr);
 }
 
-int copy_file_with_crc(int outfd, int infd, long long size) {
-    return copy_file(outfd, infd, size, &crc32_sum);
+static void write_headers_buffered(struct qfile_ctx *ctx, const struct file_header *hdr, const char *filename)
+{
+    if (!write_all_with_crc(ctx, ctx->out_fd, hdr, sizeof(*hdr))
+            || !write_all_with_crc(ctx, ctx->out_fd, filename, hdr->namelen)) {
+        qfile_set_block(ctx, ctx->in_fd);
+        qfile_ctx_wait_for_result(ctx);
+        receiver_gone(ctx);
+    }
 }
 
-int single_file_processor(const char *filename, const struct stat *st)
+void qfile_ctx_write_headers(struct qfile_ctx *ctx, const struct file_header *hdr, const char *filename)
+{
+    /* the caller may write the file data on its own */
+    write_headers_buffered(ctx, hdr, filename);
+    if (!flush_outbuf(ctx)) {
+        qfile_set_block(ctx, ctx->in_fd);
+        qfile_ctx_wait_for_result(ctx);
+        receiver_gone(ctx);
+    }
+}
+
+static void write_ext_record(struct qfile_ctx *ctx, int type, const void *payload, int len)
 {
     struct file_header hdr;
-    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.namelen = 1;
+    hdr.mode = QFILE_S_IFEXT | type;
+    hdr.filelen = len;
+    write_headers_buffered(ctx, &hdr, "");
+    if (!write_all_with_crc(ctx, ctx->out_fd, payload, len)) {
+        qfile_set_block(ctx, ctx->in_fd);
+        qfile_ctx_wait_for_result(ctx);
+        receiver_gone(ctx);
+    }
+}
+
+uint32_t qfile_ctx_pack_negotiate(struct qfile_ctx *ctx, uint32_t features)
+{
+    struct pack_state *ps = ctx->pack;
+    struct qfile_ext_hello hello;
+    struct result_header hdr;
+
+    /* codecs not built in are not offered */
+    features &= ~((QFILE_FEATURE_ZSTD | QFILE_FEATURE_LZ4) & ~compress_features());
+    if (!ps->stripe.count)
+        features &= ~QFILE_FEATURE_STRIPE;
+    hello.features = features;
+    hello._pad = 0;
+    write_ext_record(ctx, QFILE_EXT_HELLO, &hello, sizeof(hello));
+    if (!flush_outbuf(ctx)) {
+        qfile_set_block(ctx, ctx->in_fd);
+        qfile_ctx_wait_for_result(ctx);
+        receiver_gone(ctx);
+    }
+    qfile_set_block(ctx, ctx->in_fd);
+    if (!qfile_read_all(ctx, ctx->in_fd, &hdr, sizeof(hdr)))
+        receiver_gone(ctx);
+    /* older receivers reject the hello, this reports that */
+    handle_result(ctx, &hdr);
+    ps->pack_features = hdr._pad & features;
+    if (ps->pack_features & QFILE_FEATURE_STRIPE) {
+        struct qfile_ext_stripe stripe;
+        if (!qfile_read_all(ctx, ctx->in_fd, &stripe, sizeof(stripe)))
+            receiver_gone(ctx);
+        ps->stripe_channels = stripe.channels < ps->stripe.count ?
+            stripe.channels : ps->stripe.count;
+        /* the channel threads are started now, or the channels are not used */
+        if (!ps->stripe_channels || stripe_start(&ps->stripe) < 0)
+            ps->pack_features &= ~QFILE_FEATURE_STRIPE;
+    }
+    if (ps->pack_features & QFILE_FEATURE_RESUME) {
+        struct qfile_resume_point point;
+        if (!qfile_read_all(ctx, ctx->in_fd, &point, sizeof(point)) ||
+                point.namelen > MAX_PATH_LENGTH ||
+                !qfile_read_all(ctx, ctx->in_fd, ps->resume_name, point.namelen))
+            receiver_gone(ctx);
+        ps->resume_name[point.namelen] = '\0';
+        sanitize_remote_filename(ps->resume_name);
+        ps->resume_skip = point.entries;
+        ps->resume_crc = point.crc32;
+    }
+    ps->pack_codec = compress_codec(ps->pack_features);
+    if (ps->pack_codec)
+        compress_level_range(ps->pack_codec, &ps->compress_level_min,
+                             &ps->compress_level_max, &ps->compress_level);
+    qfile_set_nonblock(ctx, ctx->in_fd);
+    return ps->pack_features;
+}
+
+/*
+ * Find data extents of a file with SEEK_DATA/SEEK_HOLE.  Returns the number
+ * of extents, or -1 if that failed.  If there are too many of them, the last
+ * one covers the rest of the file.
+ */
+static int map_file_extents(struct qfile_ctx *ctx, int fd, off_t size)
+{
+    struct pack_state *ps = ctx->pack;
+    off_t data, hole = 0;
+    int count = 0;
+
+    while (hole < size) {
+        data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) /* no more data */
+                break;
+            return -1;
+        }
+        if (data >= size)
+            break;
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+            return -1;
+        if (hole > size)
+            hole = size;
+        if (count == QFILE_MAX_EXTENTS) {
+            ps->extents[count - 1].length = size - ps->extents[count - 1].offset;
+            break;
+        }
+        ps->extents[count].offset = data;
+        ps->extents[count].length = hole - data;
+        count++;
+    }
+    return count;
+}
+
+/* send file data, from the current file position */
+static void send_file_data(struct qfile_ctx *ctx, int fd, const char *filename, long long size)
+{
+    int ret;
+
+    ret = buffer_file_contents(ctx, fd, size);
+    if (ret < 0)
+        ret = qfile_ctx_copy_file_with_crc(ctx, ctx->out_fd, fd, size);
+    if (ret != COPY_FILE_OK) {
+        if (ret != COPY_FILE_WRITE_ERROR)
+            call_error_handler(ctx, "Copying file %s: %s", filename,
+                    copy_file_status_to_str(ret));
+        else {
+            qfile_set_block(ctx, ctx->in_fd);
+            qfile_ctx_wait_for_result(ctx);
+            receiver_gone(ctx);
+        }
+    }
+}
+
+/*
+ * Send a file with holes as an extent map followed by the data extents only.
+ * Returns 0 if the file is not sparse after all (nothing was sent then).
+ */
+static int send_sparse_file(struct qfile_ctx *ctx, int fd, struct file_header *hdr, const char *filename)
+{
+    struct pack_state *ps = ctx->pack;
+    unsigned long long data_len = 0;
+    int count, i;
+
+    count = map_file_extents(ctx, fd, hdr->filelen);
+    if (count < 0)
+        return 0;
+    for (i = 0; i < count; i++)
+        data_len += ps->extents[i].length;
+    if (data_len == hdr->filelen)
+        return 0;
+    write_ext_record(ctx, QFILE_EXT_SPARSE, ps->extents, count * sizeof(ps->extents[0]));
+    write_headers_buffered(ctx, hdr, filename);
+    for (i = 0; i < count; i++) {
+        if (lseek(fd, ps->extents[i].offset, SEEK_SET) < 0)
+            call_error_handler(ctx, "lseek %s", filename);
+        send_file_data(ctx, fd, filename, ps->extents[i].length);
+    }
+    return 1;
+}
+
+static size_t sent_inode_slot(struct sent_inode *table, size_t size,
+                              dev_t dev, ino_t ino)
+{
+    size_t i = (size_t)((dev * 0x9e3779b97f4a7c15ULL) ^ ino) * 0x9e3779b97f4a7c15ULL;
+
+    for (i &= size - 1; table[i].name_offset; i = (i + 1) & (size - 1))
+        if (table[i].dev == dev && table[i].ino == ino)
+            break;
+    return i;
+}
+
+/*
+ * Return the name this file was sent under before, or remember it under
+ * filename and return NULL.
+ */
+static const char *remember_sent_inode(struct qfile_ctx *ctx, const struct stat *st, const char *filename)
+{
+    struct pack_state *ps = ctx->pack;
+    size_t namelen = strlen(filename) + 1;
+    struct sent_inode *entry;
+    size_t i;
+
+    if (ps->sent_inodes_count >= ps->sent_inodes_size / 2) {
+        size_t new_size = ps->sent_inodes_size ? ps->sent_inodes_size * 2 : 256;
+        struct sent_inode *table = calloc(new_size, sizeof(*table));
+        if (!table)
+            call_error_handler(ctx, "%s: %s", filename, strerror(ENOMEM));
+        for (i = 0; i < ps->sent_inodes_size; i++) {
+            if (!ps->sent_inodes[i].name_offset)
+                continue;
+            table[sent_inode_slot(table, new_size, ps->sent_inodes[i].dev,
+                                  ps->sent_inodes[i].ino)] = ps->sent_inodes[i];
+        }
+        free(ps->sent_inodes);
+        ps->sent_inodes = table;
+        ps->sent_inodes_size = new_size;
+    }
+    entry = &ps->sent_inodes[sent_inode_slot(ps->sent_inodes, ps->sent_inodes_size,
+                                         st->st_dev, st->st_ino)];
+    if (entry->name_offset)
+        return ps->sent_names + entry->name_offset;
+    /* offset 0 marks an empty slot */
+    if (!ps->sent_names_len)
+        ps->sent_names_len = 1;
+    if (ps->sent_names_len + namelen > ps->sent_names_size) {
+        size_t new_size = ps->sent_names_size ? ps->sent_names_size : 4096;
+        char *names;
+        while (new_size < ps->sent_names_len + namelen)
+            new_size *= 2;
+        names = realloc(ps->sent_names, new_size);
+        if (!names)
+            call_error_handler(ctx, "%s: %s", filename, strerror(ENOMEM));
+        ps->sent_names = names;
+        ps->sent_names_size = new_size;
+    }
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->name_offset = ps->sent_names_len;
+    memcpy(ps->sent_names + ps->sent_names_len, filename, namelen);
+    ps->sent_names_len += namelen;
+    ps->sent_inodes_count++;
+    return NULL;
+}
+
+/* smaller files are not worth a round trip to the receiver */
+#define HASH_SKIP_MIN_SIZE (1024 * 1024)
+
+/*
+ * Announce the file content hash and send the data only if the receiver
+ * does not have it already.  Returns 0 if the file could not be hashed
+ * (nothing was sent then).
+ */
+static int send_hashed_file(struct qfile_ctx *ctx, int fd, struct file_header *hdr, const char *filename)
+{
+    struct qfile_ext_hash hash;
+    struct result_header result;
+
+    hash.size = hdr->filelen;
+    if (sha256_fd(fd, hdr->filelen, hash.sha256))
+        return 0;
+    write_ext_record(ctx, QFILE_EXT_HASH, &hash, sizeof(hash));
+    write_headers_buffered(ctx, hdr, filename);
+    if (!flush_outbuf(ctx)) {
+        qfile_set_block(ctx, ctx->in_fd);
+        qfile_ctx_wait_for_result(ctx);
+        receiver_gone(ctx);
+    }
+    qfile_set_block(ctx, ctx->in_fd);
+    if (!qfile_read_all(ctx, ctx->in_fd, &result, sizeof(result)))
+        receiver_gone(ctx);
+    handle_result(ctx, &result);
+    qfile_set_nonblock(ctx, ctx->in_fd);
+    if (!result._pad)
+        send_file_data(ctx, fd, filename, hdr->filelen);
+    return 1;
+}
+
+/* smaller files are sent as they are */
+#define COMPRESS_MIN_SIZE 4096
+/* reconsider the compression level after this many blocks */
+#define COMPRESS_ADAPT_BLOCKS 8
+
+static long long ns_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+static void adapt_compress_level(struct qfile_ctx *ctx)
+{
+    struct pack_state *ps = ctx->pack;
+
+    if (++ps->compress_blocks < COMPRESS_ADAPT_BLOCKS)
+        return;
+    if (ps->compress_ns > 2 * ps->compress_write_ns && ps->compress_level > ps->compress_level_min)
+        ps->compress_level--;
+    else if (ps->compress_write_ns > 2 * ps->compress_ns && ps->compress_level < ps->compress_level_max)
+        ps->compress_level++;
+    ps->compress_blocks = 0;
+    ps->compress_ns = ps->compress_write_ns = 0;
+}
+
+static void read_block(struct qfile_ctx *ctx, int fd, char *buf, size_t len, const char *filename)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = read(fd, buf, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            call_error_handler(ctx, "Copying file %s: %s", filename,
+                    copy_file_status_to_str(ret ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF));
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/*
+ * Send the file data as compressed blocks.  Returns 0 if the first block
+ * does not compress well (nothing was sent then).
+ */
+static int send_compressed_file(struct qfile_ctx *ctx, int fd, struct file_header *hdr, const char *filename)
+{
+    struct pack_state *ps = ctx->pack;
+    struct qfile_ext_compress ext;
+    struct qfile_block block;
+    unsigned long long left = hdr->filelen;
+    struct timespec t0, t1, t2;
+    size_t len;
+    int first = 1;
+
+    while (left) {
+        block.raw_len = left < QFILE_BLOCK_SIZE ? left : QFILE_BLOCK_SIZE;
+        read_block(ctx, fd, ps->compress_in, block.raw_len, filename);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        len = compress_block(&ps->compress, ps->pack_codec, ps->compress_level, ps->compress_out,
+                             ps->compress_in, block.raw_len);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (first) {
+            /* already compressed data (media, archives) is sent as it is */
+            if (!len || len > block.raw_len - block.raw_len / 16) {
+                if (lseek(fd, 0, SEEK_SET) < 0)
+                    call_error_handler(ctx, "lseek %s", filename);
+                return 0;
+            }
+            ext.codec = ps->pack_codec;
+            ext._pad = 0;
+            write_ext_record(ctx, QFILE_EXT_COMPRESS, &ext, sizeof(ext));
+            write_headers_buffered(ctx, hdr, filename);
+            first = 0;
+        }
+        block.stored_len = len ? len : block.raw_len;
+        if (!write_all_with_crc(ctx, ctx->out_fd, &block, sizeof(block)) ||
+                !write_all_with_crc(ctx, ctx->out_fd, len ? ps->compress_out : ps->compress_in,
+                                    block.stored_len)) {
+            qfile_set_block(ctx, ctx->in_fd);
+            qfile_ctx_wait_for_result(ctx);
+            receiver_gone(ctx);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        ps->compress_ns += ns_between(&t0, &t1);
+        ps->compress_write_ns += ns_between(&t1, &t2);
+        adapt_compress_level(ctx);
+        qfile_notify_progress(ctx, block.raw_len, 0);
+        left -= block.raw_len;
+    }
+    return 1;
+}
+
+/* smaller files are not worth splitting */
+#define STRIPE_MIN_SIZE (2 * QFILE_STRIPE_CHUNK_SIZE)
+
+void qfile_ctx_set_pack_channels(struct qfile_ctx *ctx, const int *fds, unsigned int count)
+{
+    struct pack_state *ps = ctx->pack;
+
+    stripe_set_fds(&ps->stripe, fds, count);
+}
+
+/*
+ * Send the file data over the data channels.  Returns 0 if the channel
+ * threads could not be started (nothing was sent then).
+ */
+static int send_striped_file(struct qfile_ctx *ctx, int fd, struct file_header *hdr, const char *filename)
+{
+    struct pack_state *ps = ctx->pack;
+    struct qfile_ext_stripe ext;
+    int ret;
+
+    if (stripe_start(&ps->stripe) < 0)
+        return 0;
+    ext.channels = ps->stripe_channels;
+    ext._pad = 0;
+    write_ext_record(ctx, QFILE_EXT_STRIPE, &ext, sizeof(ext));
+    write_headers_buffered(ctx, hdr, filename);
+    /* the receiver reads the channels only after the header */
+    if (!flush_outbuf(ctx)) {
+        qfile_set_block(ctx, ctx->in_fd);
+        qfile_ctx_wait_for_result(ctx);
+        receiver_gone(ctx);
+    }
+    ret = stripe_file(ctx, &ps->stripe, 1, fd, hdr->filelen, ps->stripe_channels);
+    if (ret != COPY_FILE_OK) {
+        if (ret != COPY_FILE_WRITE_ERROR)
+            call_error_handler(ctx, "Copying file %s: %s", filename,
+                    copy_file_status_to_str(ret));
+        qfile_set_block(ctx, ctx->in_fd);
+        qfile_ctx_wait_for_result(ctx);
+        receiver_gone(ctx);
+    }
+    return 1;
+}
+
+int qfile_ctx_copy_file_with_crc(struct qfile_ctx *ctx, int outfd, int infd, long long size) {
+    struct pack_state *ps = ctx->pack;
+
+    if (!flush_outbuf(ctx))
+        return COPY_FILE_WRITE_ERROR;
+    return copy_file_ctx(ctx, outfd, infd, size, &ps->crc32_sum);
+}
+
+/*
+ * Send one file; filename is the name for the receiver, name is the path to
+ * open, relative to dirfd.  A regular file may be already open as fd
+ * (otherwise -1).
+ */
+static void process_file_at(struct qfile_ctx *ctx, int dirfd, const char *name, const char *filename,
+                            const struct stat *st, int fd)
+{
+    struct pack_state *ps = ctx->pack;
+    struct file_header hdr;
     mode_t mode = st->st_mode;
+    const char *link_target;
+
+    ps->file_fd = fd;
+    if (ps->resume_skip) {
+        if (fd >= 0)
+            close(fd);
+        ps->file_fd = -1;
+        /* later links to it are still sent as links */
+        if (S_ISREG(mode) && (ps->pack_features & QFILE_FEATURE_HARDLINK) &&
+                st->st_nlink > 1)
+            remember_sent_inode(ctx, st, filename);
+        if (--ps->resume_skip == 0) {
+            if (strcmp(filename, ps->resume_name) != 0)
+                call_error_handler(ctx, "Cannot resume the transfer, files have changed (\"%s\" expected, \"%s\" found)",
+                        ps->resume_name, filename);
+            ps->crc32_sum = ps->resume_crc;
+        }
+        return;
+    }
 
     hdr.namelen = strlen(filename) + 1;
     hdr.mode = mode;
@@ -161,92 +869,682 @@ int single_file_processor(const char *filename, const struct stat *st)
     hdr.mtime = st->st_mtim.tv_sec;
     hdr.mtime_nsec = st->st_mtim.tv_nsec;
 
-    if (S_ISREG(mode)) {
-        int ret;
-        fd = open(filename, O_RDONLY);
+    if (S_ISREG(mode) && (ps->pack_features & QFILE_FEATURE_HARDLINK) &&
+            st->st_nlink > 1 &&
+            (link_target = remember_sent_inode(ctx, st, filename)) != NULL) {
+        if (fd >= 0)
+            close(fd);
+        ps->file_fd = -1;
+        write_ext_record(ctx, QFILE_EXT_HARDLINK, link_target, strlen(link_target) + 1);
+        hdr.filelen = 0;
+        write_headers_buffered(ctx, &hdr, filename);
+    } else if (S_ISREG(mode)) {
+        if (fd < 0)
+            fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
         if (fd < 0)
-            call_error_handler("open %s", filename);
+            call_error_handler(ctx, "open %s", filename);
+        ps->file_fd = fd;
         hdr.filelen = st->st_size;
-        write_headers(&hdr, filename);
-        ret = copy_file(1, fd, hdr.filelen, &crc32_sum);
-        if (ret != COPY_FILE_OK) {
-            if (ret != COPY_FILE_WRITE_ERROR)
-                call_error_handler("Copying file %s: %s", filename,
-                        copy_file_status_to_str(ret));
-            else {
-                set_block(0);
-                wait_for_result();
-                exit(1);
-            }
+        /* fewer blocks allocated than the size needs - there are holes */
+        if ((!(ps->pack_features & QFILE_FEATURE_SPARSE) ||
+                    st->st_blocks * 512 >= st->st_size ||
+                    !send_sparse_file(ctx, fd, &hdr, filename)) &&
+                (!(ps->pack_features & QFILE_FEATURE_HASH_SKIP) ||
+                    hdr.filelen < HASH_SKIP_MIN_SIZE ||
+                    !send_hashed_file(ctx, fd, &hdr, filename)) &&
+                (!(ps->pack_features & QFILE_FEATURE_STRIPE) ||
+                    hdr.filelen < STRIPE_MIN_SIZE ||
+                    !send_striped_file(ctx, fd, &hdr, filename)) &&
+                (!ps->pack_codec || hdr.filelen < COMPRESS_MIN_SIZE ||
+                    !send_compressed_file(ctx, fd, &hdr, filename))) {
+            write_headers_buffered(ctx, &hdr, filename);
+            send_file_data(ctx, fd, filename, hdr.filelen);
         }
         close(fd);
+        ps->file_fd = -1;
     }
     if (S_ISDIR(mode)) {
         hdr.filelen = 0;
-        write_headers(&hdr, filename);
+        write_headers_buffered(ctx, &hdr, filename);
     }
     if (S_ISLNK(mode)) {
-        char name[st->st_size + 1];
-        if (readlink(filename, name, sizeof(name)) != st->st_size)
-            call_error_handler("readlink %s", filename);
+        char target[st->st_size + 1];
+        if (readlinkat(dirfd, name, target, sizeof(target)) != st->st_size)
+            call_error_handler(ctx, "readlink %s", filename);
         hdr.filelen = st->st_size;
-        write_headers(&hdr, filename);
-        if (!write_all_with_crc(1, name, st->st_size)) {
-            set_block(0);
-            wait_for_result();
-            exit(1);
+        write_headers_buffered(ctx, &hdr, filename);
+        if (!write_all_with_crc(ctx, ctx->out_fd, target, st->st_size)) {
+            qfile_set_block(ctx, ctx->in_fd);
+            qfile_ctx_wait_for_result(ctx);
+            receiver_gone(ctx);
         }
     }
     // check for possible error from qfile-unpacker
-    wait_for_result();
+    ps->files_since_check++;
+    ps->bytes_since_check += hdr.filelen;
+    if ((ps->result_check_files && ps->files_since_check >= ps->result_check_files) ||
+            (ps->result_check_bytes && ps->bytes_since_check >= ps->result_check_bytes)) {
+        ps->files_since_check = 0;
+        ps->bytes_since_check = 0;
+        qfile_ctx_wait_for_result(ctx);
+    }
+}
+
+int qfile_ctx_pack_file(struct qfile_ctx *ctx, const char *filename, const struct stat *st)
+{
+    process_file_at(ctx, ctx->dirfd, filename, filename, st, -1);
     return 0;
 }
 
-int do_fs_walk(const char *file, int ignore_symlinks)
+void qfile_ctx_set_pack_prefetch_threads(struct qfile_ctx *ctx, unsigned int value)
+{
+    struct pack_state *ps = ctx->pack;
+
+    if (value > MAX_PREFETCH_THREADS)
+        value = MAX_PREFETCH_THREADS;
+    ps->opt_prefetch_threads = value;
+}
+
+static void *prefetch_worker(void *arg)
 {
-    char *newfile;
+    struct prefetch *pf = arg;
+    struct prefetch_job job;
     struct stat st;
-    struct dirent *ent;
-    DIR *dir;
 
-    if (lstat(file, &st))
-        call_error_handler("stat %s", file);
-    if (S_ISLNK(st.st_mode) && ignore_symlinks)
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        while (!pf->stop && pf->head == pf->tail)
+            pthread_cond_wait(&pf->queued, &pf->lock);
+        if (pf->stop)
+            break;
+        job = pf->jobs[pf->head++ % PREFETCH_QUEUE_SIZE];
+        pf->running++;
+        pthread_mutex_unlock(&pf->lock);
+        fstatat(job.dirfd, job.name, &st, AT_SYMLINK_NOFOLLOW);
+        pthread_mutex_lock(&pf->lock);
+        if (--pf->running == 0)
+            pthread_cond_broadcast(&pf->idle);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static void prefetch_start(struct qfile_ctx *ctx)
+{
+    struct pack_state *ps = ctx->pack;
+    struct prefetch *pf = &ps->prefetch;
+    pf->head = pf->tail = 0;
+    pf->stop = 0;
+    for (pf->nthreads = 0; pf->nthreads < ps->opt_prefetch_threads;
+            pf->nthreads++)
+        if (pthread_create(&pf->threads[pf->nthreads], NULL,
+                           prefetch_worker, pf))
+            break;
+}
+
+static void prefetch_stop(struct qfile_ctx *ctx)
+{
+    struct prefetch *pf = &ctx->pack->prefetch;
+    unsigned int i;
+
+    if (!pf->nthreads)
+        return;
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->queued);
+    pthread_mutex_unlock(&pf->lock);
+    for (i = 0; i < pf->nthreads; i++)
+        pthread_join(pf->threads[i], NULL);
+    pf->nthreads = 0;
+}
+
+static void prefetch_queue(struct qfile_ctx *ctx, int dirfd, const char *name)
+{
+    struct prefetch *pf = &ctx->pack->prefetch;
+    struct prefetch_job *job;
+
+    pthread_mutex_lock(&pf->lock);
+    if (pf->tail - pf->head < PREFETCH_QUEUE_SIZE) {
+        job = &pf->jobs[pf->tail++ % PREFETCH_QUEUE_SIZE];
+        job->dirfd = dirfd;
+        strcpy(job->name, name);
+        pthread_cond_signal(&pf->queued);
+    }
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/* drop the queued jobs, before dirfd gets closed */
+static void prefetch_cancel(struct qfile_ctx *ctx)
+{
+    struct prefetch *pf = &ctx->pack->prefetch;
+    pthread_mutex_lock(&pf->lock);
+    pf->head = pf->tail;
+    while (pf->running)
+        pthread_cond_wait(&pf->idle, &pf->lock);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ * Directory walker: entries are read with getdents64() and opened relative
+ * to the parent directory fd, so the kernel does not resolve the whole path
+ * again for each of them.  The path sent to the receiver is built in one
+ * buffer, extended and truncated while walking.
+ */
+#define WALK_DENTS_SIZE (32 * 1024)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int is_dot_or_dotdot(const char *name)
+{
+    return name[0] == '.' &&
+        (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+}
+
+/*
+ * Look-ahead: before sending an entry, the next opt_lookahead entries of
+ * the same batch (getdents64() call, or whole directory if sorted) are stat'ed, and the regular ones among them
+ * opened with POSIX_FADV_WILLNEED, so that reading them overlaps with
+ * sending the current one.  The window never extends past a directory,
+ * as its whole subtree is sent before the entries that follow it.
+ */
+#define LOOKAHEAD_MAX 64
+#define LOOKAHEAD_READAHEAD_MAX (1024 * 1024)
+
+struct lookahead_entry {
+    long pos; /* in the dents buffer */
+    int fd;
+    int error;
+    struct stat st;
+};
+
+/* entry to send, in the dents buffer; key is for sorting */
+struct walk_entry {
+    long pos;
+    uint64_t key;
+};
+
+struct walk_level {
+    struct walk_level *up;
+    int dirfd;
+    char *dents;
+    size_t dents_size;
+    struct walk_entry *order;
+    size_t order_size;
+    unsigned int norder;
+    struct lookahead_entry ahead[LOOKAHEAD_MAX];
+    unsigned int first, count;
+    /* next entry to look at, index in order */
+    unsigned int ahead_idx;
+    /* a directory is in the window */
+    int dir_pending;
+};
+
+
+void qfile_ctx_set_pack_lookahead(struct qfile_ctx *ctx, unsigned int entries)
+{
+    struct pack_state *ps = ctx->pack;
+
+    if (entries > LOOKAHEAD_MAX)
+        entries = LOOKAHEAD_MAX;
+    ps->opt_lookahead = entries;
+}
+
+/* lstat(), asking only for the fields used here, without a resync */
+static int lookahead_stat(struct qfile_ctx *ctx, int dirfd, const char *name,
+                          struct stat *st)
+{
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+
+    if (!ctx->pack->no_statx) {
+        if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO |
+                  STATX_SIZE | STATX_BLOCKS | STATX_ATIME | STATX_MTIME,
+                  &stx) == 0) {
+            memset(st, 0, sizeof(*st));
+            st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            st->st_ino = stx.stx_ino;
+            st->st_nlink = stx.stx_nlink;
+            st->st_mode = stx.stx_mode;
+            st->st_size = stx.stx_size;
+            st->st_blocks = stx.stx_blocks;
+            st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+            st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+            st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+            st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return -1;
+        ctx->pack->no_statx = 1;
+    }
+#else
+    (void)ctx;
+#endif
+    return fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+static void lookahead_fill(struct qfile_ctx *ctx, struct walk_level *lv, int dirfd)
+{
+    struct pack_state *ps = ctx->pack;
+    struct linux_dirent64 *ent;
+    struct lookahead_entry *la;
+
+    while (!lv->dir_pending && lv->count < ps->opt_lookahead &&
+            lv->ahead_idx < lv->norder) {
+        la = &lv->ahead[(lv->first + lv->count) % LOOKAHEAD_MAX];
+        la->pos = lv->order[lv->ahead_idx++].pos;
+        ent = (struct linux_dirent64 *)(lv->dents + la->pos);
+        lv->count++;
+        la->fd = -1;
+        la->error = lookahead_stat(ctx, dirfd, ent->d_name, &la->st) ? errno : 0;
+        if (la->error)
+            continue;
+        if (S_ISDIR(la->st.st_mode))
+            lv->dir_pending = 1;
+        if (!S_ISREG(la->st.st_mode) || la->st.st_size == 0)
+            continue;
+        la->fd = openat(dirfd, ent->d_name,
+                        O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+        if (la->fd >= 0)
+            posix_fadvise(la->fd, 0,
+                          la->st.st_size < LOOKAHEAD_READAHEAD_MAX ?
+                          la->st.st_size : LOOKAHEAD_READAHEAD_MAX,
+                          POSIX_FADV_WILLNEED);
+    }
+}
+
+/* stat the entry at pos (the next one), using the look-ahead if enabled */
+static int lookahead_take(struct qfile_ctx *ctx, struct walk_level *lv, int dirfd, long pos,
+                          struct stat *st, int *fd)
+{
+    struct pack_state *ps = ctx->pack;
+    struct linux_dirent64 *ent = (struct linux_dirent64 *)(lv->dents + pos);
+    struct lookahead_entry *la;
+
+    *fd = -1;
+    if (!ps->opt_lookahead)
+        return fstatat(dirfd, ent->d_name, st, AT_SYMLINK_NOFOLLOW);
+    lookahead_fill(ctx, lv, dirfd);
+    la = &lv->ahead[lv->first];
+    /* entries are taken in order, so this one is first in the window */
+    if (!lv->count || la->pos != pos)
+        abort();
+    lv->first = (lv->first + 1) % LOOKAHEAD_MAX;
+    lv->count--;
+    if (la->error) {
+        errno = la->error;
+        return -1;
+    }
+    if (S_ISDIR(la->st.st_mode))
+        lv->dir_pending = 0;
+    *st = la->st;
+    *fd = la->fd;
+    return 0;
+}
+
+/*
+ * Files smaller than this are not worth an open() and FIEMAP each: they are
+ * sorted by inode number, before the bigger ones.
+ */
+#define PHYSICAL_ORDER_MIN_SIZE (64 * 1024)
+
+/*
+ * Physical address of the first extent of a regular file (0 if unknown,
+ * none, or the file is small), for QFILE_PACK_ORDER_PHYSICAL.
+ */
+static uint64_t first_extent_address(int dirfd, const char *name)
+{
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+    struct stat st;
+    int fd;
+    uint64_t addr = 0;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode) ||
+            st.st_size < PHYSICAL_ORDER_MIN_SIZE)
         return 0;
-    single_file_processor(file, &st);
-    if (!S_ISDIR(st.st_mode))
+    fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0)
         return 0;
-    dir = opendir(file);
-    if (!dir)
-        call_error_handler("opendir %s", file);
-    while ((ent = readdir(dir))) {
-        char *fname = ent->d_name;
-        if (!strcmp(fname, ".") || !strcmp(fname, ".."))
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents == 1 &&
+            !(fm.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+        addr = fm.extent.fe_physical;
+    close(fd);
+    return addr;
+}
+
+static int compare_walk_entries(const void *a, const void *b, void *arg)
+{
+    const struct walk_entry *ea = a, *eb = b;
+    const char *dents = arg;
+    uint64_t ia, ib;
+
+    if (ea->key != eb->key)
+        return ea->key < eb->key ? -1 : 1;
+    ia = ((const struct linux_dirent64 *)(dents + ea->pos))->d_ino;
+    ib = ((const struct linux_dirent64 *)(dents + eb->pos))->d_ino;
+    return ia < ib ? -1 : ia > ib;
+}
+
+static void *grow_buffer(struct qfile_ctx *ctx, void *buf, size_t *size, size_t needed, size_t elem)
+{
+    struct pack_state *ps = ctx->pack;
+    size_t new_size = *size ? *size : 1;
+
+    if (needed <= *size)
+        return buf;
+    while (new_size < needed)
+        new_size *= 2;
+    buf = realloc(buf, new_size * elem);
+    if (!buf)
+        call_error_handler(ctx, "%s: %s", ps->walk_path, strerror(ENOMEM));
+    *size = new_size;
+    return buf;
+}
+
+/*
+ * Read the next batch of entries into lv: one getdents64() call, or the
+ * whole directory sorted according to opt_pack_order.  Returns 0 at the end.
+ */
+static int read_walk_batch(struct qfile_ctx *ctx, struct walk_level *lv, int dirfd)
+{
+    struct pack_state *ps = ctx->pack;
+    int sorted = ps->opt_pack_order != QFILE_PACK_ORDER_READDIR;
+    size_t len = 0;
+    long ret, pos;
+
+    /* a big or cold directory can take long to read */
+    if (!flush_outbuf(ctx)) {
+        qfile_set_block(ctx, ctx->in_fd);
+        qfile_ctx_wait_for_result(ctx);
+        receiver_gone(ctx);
+    }
+    struct linux_dirent64 *ent;
+
+    do {
+        lv->dents = grow_buffer(ctx, lv->dents, &lv->dents_size,
+                                len + WALK_DENTS_SIZE, 1);
+        ret = syscall(SYS_getdents64, dirfd, lv->dents + len, WALK_DENTS_SIZE);
+        if (ret < 0)
+            call_error_handler(ctx, "readdir %s", ps->walk_path);
+        len += ret;
+    } while (sorted && ret > 0);
+
+    lv->norder = 0;
+    for (pos = 0; pos < (long)len; pos += ent->d_reclen) {
+        ent = (struct linux_dirent64 *)(lv->dents + pos);
+        if (is_dot_or_dotdot(ent->d_name))
             continue;
-        if (asprintf(&newfile, "%s/%s", file, fname) >= 0) {
-            do_fs_walk(newfile, ignore_symlinks);
-            free(newfile);
-        } else {
-            fprintf(stderr, "asprintf failed\n");
-            exit(1);
+        if (ps->prefetch.nthreads)
+            prefetch_queue(ctx, dirfd, ent->d_name);
+        lv->order = grow_buffer(ctx, lv->order, &lv->order_size, lv->norder + 1,
+                                sizeof(*lv->order));
+        lv->order[lv->norder].pos = pos;
+        lv->order[lv->norder].key = 0;
+        if (ps->opt_pack_order == QFILE_PACK_ORDER_INODE)
+            lv->order[lv->norder].key = ent->d_ino;
+        else if (ps->opt_pack_order == QFILE_PACK_ORDER_PHYSICAL &&
+                (ent->d_type == DT_REG || ent->d_type == DT_UNKNOWN))
+            lv->order[lv->norder].key = first_extent_address(dirfd, ent->d_name);
+        lv->norder++;
+    }
+    if (sorted)
+        qsort_r(lv->order, lv->norder, sizeof(*lv->order),
+                compare_walk_entries, lv->dents);
+    lv->ahead_idx = 0;
+    return len > 0;
+}
+
+/* walk_path holds the directory path (pathlen bytes) on entry */
+static void walk_dir(struct qfile_ctx *ctx, int dirfd, size_t pathlen, int ignore_symlinks)
+{
+    struct pack_state *ps = ctx->pack;
+    struct walk_level *lv;
+    struct linux_dirent64 *ent;
+    unsigned int i;
+    size_t namelen;
+    struct stat st;
+    int fd, subdirfd;
+
+    lv = calloc(1, sizeof(*lv));
+    if (!lv)
+        call_error_handler(ctx, "opendir %s: %s", ps->walk_path, strerror(ENOMEM));
+    lv->up = ps->walk_top;
+    lv->dirfd = dirfd;
+    ps->walk_top = lv;
+    while (read_walk_batch(ctx, lv, dirfd)) {
+        for (i = 0; i < lv->norder; i++) {
+            ent = (struct linux_dirent64 *)(lv->dents + lv->order[i].pos);
+            namelen = strlen(ent->d_name);
+            if (pathlen + 1 + namelen >= sizeof(ps->walk_path))
+                call_error_handler(ctx, "%s/%s: %s", ps->walk_path, ent->d_name,
+                                   strerror(ENAMETOOLONG));
+            ps->walk_path[pathlen] = '/';
+            memcpy(ps->walk_path + pathlen + 1, ent->d_name, namelen + 1);
+            if (lookahead_take(ctx, lv, dirfd, lv->order[i].pos, &st, &fd))
+                call_error_handler(ctx, "stat %s", ps->walk_path);
+            if (S_ISLNK(st.st_mode) && ignore_symlinks)
+                continue;
+            process_file_at(ctx, dirfd, ent->d_name, ps->walk_path, &st, fd);
+            if (!S_ISDIR(st.st_mode))
+                continue;
+            subdirfd = openat(dirfd, ent->d_name,
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subdirfd < 0)
+                call_error_handler(ctx, "opendir %s", ps->walk_path);
+            walk_dir(ctx, subdirfd, pathlen + 1 + namelen, ignore_symlinks);
+            close(subdirfd);
+            // directory metadata is resent; this makes the code simple,
+            // and the atime/mtime is set correctly at the second time
+            // (unless the receiver fixes them up at the end itself)
+            if (!(ps->pack_features & QFILE_FEATURE_DIR_ONCE))
+                process_file_at(ctx, dirfd, ent->d_name, ps->walk_path, &st, -1);
         }
+        ps->walk_path[pathlen] = 0;
     }
-    closedir(dir);
+    if (ps->prefetch.nthreads)
+        prefetch_cancel(ctx);
+    ps->walk_top = lv->up;
+    free(lv->dents);
+    free(lv->order);
+    free(lv);
+    ps->walk_path[pathlen] = 0;
+}
+
+void qfile_ctx_set_pack_order(struct qfile_ctx *ctx, enum qfile_pack_order order)
+{
+    struct pack_state *ps = ctx->pack;
+
+    ps->opt_pack_order = order;
+}
+
+int qfile_ctx_pack_walk(struct qfile_ctx *ctx, const char *file, int ignore_symlinks)
+{
+    struct pack_state *ps = ctx->pack;
+    struct stat st, dir_st;
+    size_t pathlen = strlen(file);
+    int dirfd;
+
+    if (fstatat(ctx->dirfd, file, &st, AT_SYMLINK_NOFOLLOW))
+        call_error_handler(ctx, "stat %s", file);
+    if (S_ISLNK(st.st_mode) && ignore_symlinks)
+        return 0;
+    qfile_ctx_pack_file(ctx, file, &st);
+    if (!S_ISDIR(st.st_mode))
+        return 0;
+    if (pathlen >= sizeof(ps->walk_path))
+        call_error_handler(ctx, "%s: %s", file, strerror(ENAMETOOLONG));
+    memcpy(ps->walk_path, file, pathlen + 1);
+    /* like the levels below, and the directory that was sent above */
+    dirfd = openat(ctx->dirfd, file, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirfd < 0)
+        call_error_handler(ctx, "opendir %s", file);
+    if (fstat(dirfd, &dir_st))
+        call_error_handler(ctx, "stat %s", file);
+    if (dir_st.st_dev != st.st_dev || dir_st.st_ino != st.st_ino)
+        call_error_handler(ctx, "%s: directory replaced during the copy", file);
+    prefetch_start(ctx);
+    walk_dir(ctx, dirfd, pathlen, ignore_symlinks);
+    prefetch_stop(ctx);
+    close(dirfd);
     // directory metadata is resent; this makes the code simple,
     // and the atime/mtime is set correctly at the second time
-    single_file_processor(file, &st);
+    if (!(ps->pack_features & QFILE_FEATURE_DIR_ONCE))
+        qfile_ctx_pack_file(ctx, file, &st);
     return 0;
 }
 
-void qfile_pack_init(void) {
-    crc32_sum = 0;
-    ignore_quota_error = 0;
+void pack_abort(struct qfile_ctx *ctx)
+{
+    struct pack_state *ps = ctx->pack;
+    struct walk_level *lv;
+    unsigned int i;
+    int fd;
+
+    prefetch_stop(ctx);
+    stripe_stop(&ps->stripe);
+    while ((lv = ps->walk_top) != NULL) {
+        for (i = 0; i < lv->count; i++) {
+            fd = lv->ahead[(lv->first + i) % LOOKAHEAD_MAX].fd;
+            if (fd >= 0)
+                close(fd);
+        }
+        close(lv->dirfd);
+        ps->walk_top = lv->up;
+        free(lv->dents);
+        free(lv->order);
+        free(lv);
+    }
+    if (ps->file_fd >= 0)
+        close(ps->file_fd);
+    ps->file_fd = -1;
+}
+
+int qfile_ctx_start_pack(struct qfile_ctx *ctx, qfile_pack_func_t *func, void *data)
+{
+    return qfile_driver_start(ctx, func, data);
+}
+
+void qfile_ctx_pack_init(struct qfile_ctx *ctx) {
+    struct pack_state *ps = ctx->pack;
+
+    ps->crc32_sum = 0;
+    ps->ignore_quota_error = 0;
+    ps->pack_features = 0;
+    ps->stripe_channels = 0;
+    ps->pack_codec = 0;
+    ps->resume_skip = 0;
+    ps->outbuf_len = 0;
+    if (ps->sent_inodes)
+        memset(ps->sent_inodes, 0, ps->sent_inodes_size * sizeof(*ps->sent_inodes));
+    ps->sent_inodes_count = 0;
+    ps->sent_names_len = 0;
+    ps->files_since_check = 0;
+    ps->bytes_since_check = 0;
     // this will allow checking for possible feedback packet in the middle of transfer
-    set_nonblock(0);
+    qfile_set_nonblock(ctx, ctx->in_fd);
     signal(SIGPIPE, SIG_IGN);
-    error_handler = NULL;
 }
 
-void set_ignore_quota_error(int value) {
-    ignore_quota_error = value;
+void qfile_ctx_set_ignore_quota_error(struct qfile_ctx *ctx, int value) {
+    struct pack_state *ps = ctx->pack;
+
+    ps->ignore_quota_error = value;
+}
+
+void qfile_ctx_set_result_check_interval(struct qfile_ctx *ctx, unsigned int files, unsigned long long bytes) {
+    struct pack_state *ps = ctx->pack;
+
+    ps->result_check_files = files;
+    ps->result_check_bytes = bytes;
+}
+
+/* the traditional API, on the default context */
+
+void qfile_pack_init(void)
+{
+    qfile_ctx_pack_init(qfile_default_ctx());
+    qfile_default_ctx()->legacy_error_handler = NULL;
+}
+
+uint32_t qfile_pack_negotiate(uint32_t features)
+{
+    return qfile_ctx_pack_negotiate(qfile_default_ctx(), features);
+}
+
+int single_file_processor(const char *filename, const struct stat *st)
+{
+    return qfile_ctx_pack_file(qfile_default_ctx(), filename, st);
+}
+
+int do_fs_walk(const char *file, int ignore_symlinks)
+{
+    return qfile_ctx_pack_walk(qfile_default_ctx(), file, ignore_symlinks);
+}
+
+void write_headers(const struct file_header *hdr, const char *filename)
+{
+    qfile_ctx_write_headers(qfile_default_ctx(), hdr, filename);
+}
+
+int copy_file_with_crc(int outfd, int infd, long long size)
+{
+    return qfile_ctx_copy_file_with_crc(qfile_default_ctx(), outfd, infd, size);
+}
+
+void set_ignore_quota_error(int value)
+{
+    qfile_ctx_set_ignore_quota_error(qfile_default_ctx(), value);
+}
+
+void set_pack_prefetch_threads(unsigned int value)
+{
+    qfile_ctx_set_pack_prefetch_threads(qfile_default_ctx(), value);
+}
+
+void set_pack_lookahead(unsigned int entries)
+{
+    qfile_ctx_set_pack_lookahead(qfile_default_ctx(), entries);
+}
+
+void set_pack_order(enum qfile_pack_order order)
+{
+    qfile_ctx_set_pack_order(qfile_default_ctx(), order);
+}
+
+void set_pack_batching(unsigned long max_bytes, unsigned int max_delay_ms)
+{
+    qfile_ctx_set_pack_batching(qfile_default_ctx(), max_bytes, max_delay_ms);
+}
+
+void set_result_check_interval(unsigned int files, unsigned long long bytes)
+{
+    qfile_ctx_set_result_check_interval(qfile_default_ctx(), files, bytes);
+}
+
+void set_pack_channels(const int *fds, unsigned int count)
+{
+    qfile_ctx_set_pack_channels(qfile_default_ctx(), fds, count);
+}
+
+void wait_for_result(void)
+{
+    qfile_ctx_wait_for_result(qfile_default_ctx());
+}
+
+void notify_end_and_wait_for_result(void)
+{
+    qfile_ctx_notify_end_and_wait_for_result(qfile_default_ctx());
 }
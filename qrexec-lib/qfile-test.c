@@ -0,0 +1,825 @@
+/*
+ * Loopback test of the file copy protocol: a directory tree is packed and
+ * unpacked by two processes connected with pipes, plainly and with each of
+ * the protocol extensions, and the copy is compared with the original.  The
+ * size limits are checked the same way, and malformed extension records are
+ * fed directly to a driven unpacker.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libqubes-rpc-filecopy.h"
+#ifdef NDEBUG
+// without assertions this test program would not test anything
+# error "File copy test program does not work without assertions."
+#endif
+#include <assert.h>
+
+#define BIG_SIZE (3 * 1024 * 1024)
+#define SPARSE_SIZE (8 * 1024 * 1024)
+#define SPARSE_EXTENT (64 * 1024)
+#define QUOTA_FILE_SIZE (100 * 1024)
+
+static char base[256];
+static int base_fd;
+static char big[BIG_SIZE];
+/* regular file data in "tree", not counting holes */
+static unsigned long long tree_data_bytes;
+
+struct transfer {
+    const char *root;           /* what to send, in base/src */
+    const char *dst;            /* where to, in base (emptied first) */
+    uint32_t features;          /* offered; 0 - no negotiation at all */
+    unsigned int pack_channels, unpack_channels;
+    enum qfile_pack_order order;
+    int unpack_threads;
+    int incremental_sync;
+    int receiver_defaults;      /* do not enable the features on the receiver */
+    int hash_cache;             /* base/cache */
+    int journal;                /* base/journal */
+    unsigned long long bytes_limit, files_limit;
+};
+
+static void write_file(int dirfd, const char *name, const void *data, size_t len, mode_t mode)
+{
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+
+    assert(fd >= 0);
+    assert(write_all(fd, data, len));
+    assert(!close(fd));
+}
+
+static void set_time(int dirfd, const char *name, int i)
+{
+    struct timespec times[2] = {
+        { 1600000000 + i, 100000000 + i },
+        { 1500000000 + i, 999999999 - i },
+    };
+
+    assert(!utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW));
+}
+
+static void make_dir(int dirfd, const char *name, int *fd)
+{
+    assert(!mkdirat(dirfd, name, 0700));
+    *fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    assert(*fd >= 0);
+}
+
+/*
+ * tree/: small files (for the worker pool), an empty one, a sparse one and
+ * a symlink; tree/sub/: a compressible file and a hard link to it;
+ * tree/sub/deeper/: a big random file (hashed, striped).
+ */
+static void make_trees(int src_fd)
+{
+    static char text[200 * 1024];
+    int tree_fd, sub_fd, deeper_fd, quota_fd, fd, i;
+    char name[32];
+    size_t len;
+
+    for (i = 0; i < BIG_SIZE; i++)
+        big[i] = random();
+    for (len = 0; len + 64 <= sizeof(text); len += 64)
+        snprintf(text + len, 65, "line %058zu\n", len / 64);
+
+    make_dir(src_fd, "tree", &tree_fd);
+    make_dir(tree_fd, "sub", &sub_fd);
+    make_dir(sub_fd, "deeper", &deeper_fd);
+    for (i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "small-%d", i);
+        write_file(tree_fd, name, big + i * 4096, i * 97, i % 2 ? 0644 : 0600);
+        set_time(tree_fd, name, i);
+        tree_data_bytes += i * 97;
+    }
+    write_file(tree_fd, "empty", "", 0, 0640);
+    write_file(sub_fd, "text", text, len, 0644);
+    assert(!linkat(sub_fd, "text", sub_fd, "hard", 0));
+    set_time(sub_fd, "text", 100);
+    write_file(deeper_fd, "big", big, BIG_SIZE, 0600);
+    set_time(deeper_fd, "big", 101);
+    tree_data_bytes += 2 * len + BIG_SIZE;
+
+    fd = openat(tree_fd, "sparse", O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    assert(fd >= 0);
+    assert(pwrite(fd, big, SPARSE_EXTENT, 0) == SPARSE_EXTENT);
+    assert(pwrite(fd, big, SPARSE_EXTENT, SPARSE_SIZE / 2) == SPARSE_EXTENT);
+    assert(!ftruncate(fd, SPARSE_SIZE));
+    assert(!close(fd));
+    set_time(tree_fd, "sparse", 102);
+    tree_data_bytes += 2 * SPARSE_EXTENT;
+    assert(!symlinkat("sub/text", tree_fd, "link"));
+    set_time(tree_fd, "link", 103);
+
+    /* directories last, their times change with the contents */
+    set_time(sub_fd, "deeper", 104);
+    assert(!fchmod(deeper_fd, 0750));
+    set_time(tree_fd, "sub", 105);
+    assert(!fchmod(sub_fd, 0755));
+    set_time(src_fd, "tree", 106);
+    close(deeper_fd);
+    close(sub_fd);
+    close(tree_fd);
+
+    /* quota/: equally sized files, so that it does not matter which come first */
+    make_dir(src_fd, "quota", &quota_fd);
+    for (i = 0; i < 3; i++) {
+        snprintf(name, sizeof(name), "q%d", i);
+        write_file(quota_fd, name, big + i, QUOTA_FILE_SIZE, 0644);
+    }
+    close(quota_fd);
+}
+
+static void fail(const char *path, const char *what)
+{
+    fprintf(stderr, "BUG: %s: %s differs\n", path, what);
+    abort();
+}
+
+static void compare_contents(int sfd, int dfd, const char *path)
+{
+    static char sbuf[65536], dbuf[65536];
+    ssize_t slen, dlen;
+
+    do {
+        slen = read(sfd, sbuf, sizeof(sbuf));
+        dlen = read(dfd, dbuf, sizeof(dbuf));
+        assert(slen >= 0 && dlen >= 0);
+        if (slen != dlen || memcmp(sbuf, dbuf, slen))
+            fail(path, "content");
+    } while (slen);
+}
+
+static int count_entries(int dirfd)
+{
+    DIR *dir = fdopendir(dup(dirfd));
+    struct dirent *ent;
+    int count = 0;
+
+    assert(dir);
+    while ((ent = readdir(dir)))
+        count += strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..");
+    closedir(dir);
+    return count;
+}
+
+static void compare_entry(int sdir, int ddir, const char *name, const char *path)
+{
+    char spath[PATH_MAX], starget[PATH_MAX], dtarget[PATH_MAX];
+    struct stat s, d;
+    struct dirent *ent;
+    ssize_t slen, dlen;
+    int sfd, dfd;
+    DIR *dir;
+
+    assert(!fstatat(sdir, name, &s, AT_SYMLINK_NOFOLLOW));
+    if (fstatat(ddir, name, &d, AT_SYMLINK_NOFOLLOW))
+        fail(path, "existence");
+    if ((s.st_mode & S_IFMT) != (d.st_mode & S_IFMT))
+        fail(path, "type");
+    if (S_ISLNK(s.st_mode)) {
+        slen = readlinkat(sdir, name, starget, sizeof(starget));
+        dlen = readlinkat(ddir, name, dtarget, sizeof(dtarget));
+        if (slen != dlen || memcmp(starget, dtarget, slen))
+            fail(path, "symlink target");
+        return;
+    }
+    if ((s.st_mode & 07777) != (d.st_mode & 07777))
+        fail(path, "mode");
+    if (s.st_mtim.tv_sec != d.st_mtim.tv_sec || s.st_mtim.tv_nsec != d.st_mtim.tv_nsec)
+        fail(path, "mtime");
+    sfd = openat(sdir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    dfd = openat(ddir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    assert(sfd >= 0 && dfd >= 0);
+    if (S_ISREG(s.st_mode)) {
+        if (s.st_size != d.st_size)
+            fail(path, "size");
+        compare_contents(sfd, dfd, path);
+    } else if (S_ISDIR(s.st_mode)) {
+        if (count_entries(sfd) != count_entries(dfd))
+            fail(path, "number of entries");
+        dir = fdopendir(dup(sfd));
+        assert(dir);
+        while ((ent = readdir(dir))) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+            snprintf(spath, sizeof(spath), "%s/%s", path, ent->d_name);
+            compare_entry(sfd, dfd, ent->d_name, spath);
+        }
+        closedir(dir);
+    }
+    close(sfd);
+    close(dfd);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void remove_tree(const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", base, name);
+    if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS) && errno != ENOENT) {
+        perror(path);
+        abort();
+    }
+}
+
+static void quiet_error_handler(struct qfile_ctx *ctx, const char *fmt, va_list args)
+{
+    (void)ctx;
+    (void)fmt;
+    (void)args;
+}
+
+static _Noreturn void pack_child(const struct transfer *t, int in_fd, int out_fd,
+                                 const int *channels, int report_fd, int quiet)
+{
+    struct qfile_ctx *ctx = qfile_ctx_new();
+    uint32_t accepted = 0;
+    int src_fd = openat(base_fd, "src", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    assert(ctx && src_fd >= 0);
+    qfile_ctx_set_fds(ctx, in_fd, out_fd);
+    qfile_ctx_set_dirfd(ctx, src_fd);
+    if (quiet)
+        qfile_ctx_set_error_handler(ctx, quiet_error_handler);
+    qfile_ctx_pack_init(ctx);
+    qfile_ctx_set_pack_order(ctx, t->order);
+    qfile_ctx_set_pack_channels(ctx, channels, t->pack_channels);
+    if (t->features)
+        accepted = qfile_ctx_pack_negotiate(ctx, t->features);
+    assert(write(report_fd, &accepted, sizeof(accepted)) == sizeof(accepted));
+    qfile_ctx_pack_walk(ctx, t->root, 0);
+    qfile_ctx_notify_end_and_wait_for_result(ctx);
+    _exit(0);
+}
+
+static _Noreturn void unpack_child(const struct transfer *t, int in_fd, int out_fd,
+                                   const int *channels)
+{
+    struct qfile_ctx *ctx = qfile_ctx_new();
+    int dst_fd = openat(base_fd, t->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fd;
+
+    assert(ctx && dst_fd >= 0);
+    qfile_ctx_set_fds(ctx, in_fd, out_fd);
+    qfile_ctx_set_dirfd(ctx, dst_fd);
+    qfile_ctx_set_size_limit(ctx, t->bytes_limit, t->files_limit);
+    if (!t->receiver_defaults)
+        qfile_ctx_set_unpack_features(ctx, ~0u);
+    qfile_ctx_set_unpack_threads(ctx, t->unpack_threads);
+    qfile_ctx_set_incremental_sync(ctx, t->incremental_sync);
+    qfile_ctx_set_unpack_channels(ctx, channels, t->unpack_channels);
+    if (t->hash_cache) {
+        fd = openat(base_fd, "cache", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        assert(fd >= 0);
+        assert(!qfile_ctx_set_unpack_hash_cache(ctx, fd, "test-vm"));
+        close(fd);
+    }
+    if (t->journal) {
+        fd = openat(base_fd, "journal", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        assert(fd >= 0);
+        qfile_ctx_set_unpack_journal(ctx, fd);
+    }
+    _exit(qfile_ctx_unpack(ctx, COPY_ALLOW_SYMLINKS | COPY_ALLOW_DIRECTORIES));
+}
+
+/*
+ * Returns the exit code of the unpacker and the features accepted by the
+ * receiver.  The destination is kept as it is when resuming.
+ */
+static int run_transfer(const struct transfer *t, uint32_t *accepted, int expect_failure)
+{
+    int to_unpack[2], to_pack[2], report[2];
+    int channels[QFILE_MAX_CHANNELS][2];
+    int pack_fds[QFILE_MAX_CHANNELS], unpack_fds[QFILE_MAX_CHANNELS];
+    unsigned int i, nchannels;
+    pid_t pack_pid, unpack_pid;
+    int status;
+
+    if (!t->journal) {
+        remove_tree(t->dst);
+        assert(!mkdirat(base_fd, t->dst, 0700));
+    }
+    nchannels = t->pack_channels > t->unpack_channels ? t->pack_channels : t->unpack_channels;
+    for (i = 0; i < nchannels; i++) {
+        assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channels[i]));
+        pack_fds[i] = channels[i][0];
+        unpack_fds[i] = channels[i][1];
+    }
+    assert(!pipe2(to_unpack, O_CLOEXEC) && !pipe2(to_pack, O_CLOEXEC) &&
+           !pipe2(report, O_CLOEXEC));
+
+    /* the other ends must be closed, so that a failure of one side ends the other */
+    pack_pid = fork();
+    assert(pack_pid >= 0);
+    if (!pack_pid) {
+        close(to_unpack[0]);
+        close(to_pack[1]);
+        close(report[0]);
+        for (i = 0; i < nchannels; i++)
+            close(unpack_fds[i]);
+        pack_child(t, to_pack[0], to_unpack[1], pack_fds, report[1], expect_failure);
+    }
+    unpack_pid = fork();
+    assert(unpack_pid >= 0);
+    if (!unpack_pid) {
+        close(to_unpack[1]);
+        close(to_pack[0]);
+        close(report[0]);
+        close(report[1]);
+        for (i = 0; i < nchannels; i++)
+            close(pack_fds[i]);
+        unpack_child(t, to_unpack[0], to_pack[1], unpack_fds);
+    }
+    close(to_unpack[0]);
+    close(to_unpack[1]);
+    close(to_pack[0]);
+    close(to_pack[1]);
+    close(report[1]);
+    for (i = 0; i < nchannels; i++) {
+        close(channels[i][0]);
+        close(channels[i][1]);
+    }
+
+    assert(waitpid(unpack_pid, &status, 0) == unpack_pid);
+    assert(WIFEXITED(status));
+    if (read(report[0], accepted, sizeof(*accepted)) != sizeof(*accepted))
+        *accepted = 0;
+    close(report[0]);
+    if (WEXITSTATUS(status) == 0) {
+        assert(waitpid(pack_pid, &status, 0) == pack_pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        return 0;
+    }
+    /* the packer fails too (or gets SIGPIPE) */
+    assert(waitpid(pack_pid, NULL, 0) == pack_pid);
+    return WEXITSTATUS(status);
+}
+
+static uint32_t roundtrip(const struct transfer *t)
+{
+    uint32_t accepted;
+    int src_fd, dst_fd, ret;
+
+    ret = run_transfer(t, &accepted, 0);
+    if (ret) {
+        fprintf(stderr, "BUG: transfer with features %#x failed: %s\n",
+                (unsigned)t->features, strerror(ret));
+        abort();
+    }
+    src_fd = openat(base_fd, "src", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dst_fd = openat(base_fd, t->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    assert(src_fd >= 0 && dst_fd >= 0);
+    compare_entry(src_fd, dst_fd, t->root, t->root);
+    close(src_fd);
+    close(dst_fd);
+    return accepted;
+}
+
+static void dst_stat(const char *dst, const char *name, struct stat *st)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", dst, name);
+    assert(!fstatat(base_fd, path, st, AT_SYMLINK_NOFOLLOW));
+}
+
+/* the hash cache entry of the given size */
+static void find_cached(off_t size, struct stat *st)
+{
+    int fd = openat(base_fd, "cache/test-vm", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fdopendir(fd);
+    struct dirent *ent;
+    int found = 0;
+
+    assert(dir);
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.')
+            continue;
+        assert(!fstatat(fd, ent->d_name, st, AT_SYMLINK_NOFOLLOW));
+        if (st->st_size == size) {
+            found = 1;
+            break;
+        }
+    }
+    closedir(dir);
+    assert(found);
+}
+
+static void test_features(void)
+{
+    static const uint32_t single[] = {
+        QFILE_FEATURE_SPARSE,
+        QFILE_FEATURE_DIR_ONCE,
+        QFILE_FEATURE_HARDLINK,
+        QFILE_FEATURE_HASH_SKIP,
+        QFILE_FEATURE_RESUME,
+        QFILE_FEATURE_ZSTD,
+        QFILE_FEATURE_LZ4,
+        QFILE_FEATURE_STRIPE,
+    };
+    struct transfer t = { .root = "tree", .dst = "dst" };
+    struct stat src_st, st, st2, cache_st;
+    uint32_t accepted;
+    size_t i;
+
+    /* the original protocol */
+    assert(roundtrip(&t) == 0);
+    /* a receiver accepts no extensions unless told to */
+    t = (struct transfer){ .root = "tree", .dst = "dst", .features = ~0u,
+                           .receiver_defaults = 1, .hash_cache = 1 };
+    assert(roundtrip(&t) == 0);
+
+    for (i = 0; i < sizeof(single) / sizeof(single[0]); i++) {
+        t = (struct transfer){ .root = "tree", .dst = "dst", .features = single[i] };
+        t.hash_cache = single[i] == QFILE_FEATURE_HASH_SKIP;
+        if (single[i] == QFILE_FEATURE_RESUME) {
+            /* nothing to resume, the journal is emptied after success */
+            remove_tree("dst");
+            assert(!mkdirat(base_fd, "dst", 0700));
+            t.journal = 1;
+        }
+        if (single[i] == QFILE_FEATURE_STRIPE) {
+            /* the sender uses only as many channels as the receiver has */
+            t.pack_channels = 3;
+            t.unpack_channels = 2;
+        }
+        accepted = roundtrip(&t);
+        if ((single[i] & (QFILE_FEATURE_ZSTD | QFILE_FEATURE_LZ4)) && !accepted) {
+            fprintf(stderr, "skipping codec %#x, not built in\n", (unsigned)single[i]);
+            continue;
+        }
+        assert(accepted == single[i]);
+    }
+
+    /* holes are kept */
+    t = (struct transfer){ .root = "tree", .dst = "dst", .features = QFILE_FEATURE_SPARSE };
+    assert(roundtrip(&t) == QFILE_FEATURE_SPARSE);
+    assert(!fstatat(base_fd, "src/tree/sparse", &src_st, 0));
+    dst_stat("dst", "tree/sparse", &st);
+    if (src_st.st_blocks * 512 < src_st.st_size)
+        assert(st.st_blocks * 512 < st.st_size);
+
+    /* hard links are kept only with QFILE_FEATURE_HARDLINK */
+    dst_stat("dst", "tree/sub/text", &st);
+    dst_stat("dst", "tree/sub/hard", &st2);
+    assert(st.st_ino != st2.st_ino);
+    t.features = QFILE_FEATURE_HARDLINK;
+    assert(roundtrip(&t) == QFILE_FEATURE_HARDLINK);
+    dst_stat("dst", "tree/sub/text", &st);
+    dst_stat("dst", "tree/sub/hard", &st2);
+    assert(st.st_ino == st2.st_ino);
+
+    /*
+     * The big file is in the hash cache now, as a file of its own.  It is
+     * copied from there, not received, and so the cache entry stays.
+     */
+    find_cached(BIG_SIZE, &cache_st);
+    assert(!fstatat(base_fd, "src/tree/sub/deeper/big", &src_st, 0));
+    assert(cache_st.st_nlink == 1 && cache_st.st_mtim.tv_sec != src_st.st_mtim.tv_sec);
+    t = (struct transfer){ .root = "tree", .dst = "dst", .features = QFILE_FEATURE_HASH_SKIP,
+                           .hash_cache = 1 };
+    assert(roundtrip(&t) == QFILE_FEATURE_HASH_SKIP);
+    dst_stat("dst", "tree/sub/deeper/big", &st);
+    find_cached(BIG_SIZE, &st2);
+    assert(st2.st_ino == cache_st.st_ino && st.st_ino != cache_st.st_ino);
+
+    /* everything at once, with the worker pool and incremental sync */
+    t = (struct transfer){ .root = "tree", .dst = "dst", .features = ~0u,
+                           .pack_channels = 2, .unpack_channels = 4,
+                           .order = QFILE_PACK_ORDER_PHYSICAL,
+                           .unpack_threads = 4, .incremental_sync = 1, .hash_cache = 1 };
+    accepted = roundtrip(&t);
+    assert(accepted & QFILE_FEATURE_STRIPE);
+    assert(!(accepted & QFILE_FEATURE_RESUME));
+}
+
+static void test_limits(void)
+{
+    struct transfer t;
+    uint32_t accepted;
+
+    /* files small enough for the worker pool, limit below their size */
+    t = (struct transfer){ .root = "tree", .dst = "dst", .unpack_threads = 4,
+                           .bytes_limit = 1000 };
+    assert(run_transfer(&t, &accepted, 1) == EDQUOT);
+    t = (struct transfer){ .root = "tree", .dst = "dst", .unpack_threads = 4,
+                           .files_limit = 5 };
+    assert(run_transfer(&t, &accepted, 1) == EDQUOT);
+
+    /* only the data of sparse files counts */
+    t = (struct transfer){ .root = "tree", .dst = "dst",
+                           .features = QFILE_FEATURE_SPARSE | QFILE_FEATURE_HARDLINK,
+                           .bytes_limit = tree_data_bytes + 1024 * 1024 };
+    roundtrip(&t);
+    t.features = QFILE_FEATURE_HARDLINK;
+    assert(run_transfer(&t, &accepted, 1) == EDQUOT);
+
+    /*
+     * The limits apply to the whole of a resumed transfer: the first attempt
+     * gets two of the three files, resuming with the same limit fails on
+     * the third one, and without a limit it completes.
+     */
+    remove_tree("dst");
+    assert(!mkdirat(base_fd, "dst", 0700));
+    t = (struct transfer){ .root = "quota", .dst = "dst", .features = QFILE_FEATURE_RESUME,
+                           .journal = 1, .bytes_limit = 5 * QUOTA_FILE_SIZE / 2 };
+    assert(run_transfer(&t, &accepted, 1) == EDQUOT);
+    assert(accepted == QFILE_FEATURE_RESUME);
+    assert(run_transfer(&t, &accepted, 1) == EDQUOT);
+    t.bytes_limit = 0;
+    roundtrip(&t);
+}
+
+/* a hand-made stream for a driven unpacker */
+struct stream {
+    char buf[4096];
+    size_t len;
+    /* a file already in the destination, if set */
+    const char *existing;
+    int unpack_threads;
+};
+
+static void add(struct stream *s, const void *data, size_t len)
+{
+    assert(s->len + len <= sizeof(s->buf));
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+}
+
+static void add_entry(struct stream *s, uint32_t mode, const char *name,
+                      const void *data, size_t len)
+{
+    struct file_header hdr = {
+        .namelen = strlen(name) + 1,
+        .mode = mode,
+        .filelen = len,
+    };
+
+    add(s, &hdr, sizeof(hdr));
+    add(s, name, hdr.namelen);
+    add(s, data, len);
+}
+
+static void add_ext(struct stream *s, uint32_t type, const void *payload, size_t len)
+{
+    add_entry(s, QFILE_S_IFEXT | type, "", payload, len);
+}
+
+static void add_hello(struct stream *s, uint32_t features)
+{
+    struct qfile_ext_hello hello = { features, 0 };
+
+    add_ext(s, QFILE_EXT_HELLO, &hello, sizeof(hello));
+}
+
+static void add_end(struct stream *s)
+{
+    struct file_header hdr = { 0 };
+
+    add(s, &hdr, sizeof(hdr));
+}
+
+/* returns the status of the unpacker fed with the stream */
+static int unpack_stream(const struct stream *s, int channel_fd)
+{
+    struct qfile_ctx *ctx = qfile_ctx_new();
+    const char *in = s->buf;
+    size_t in_len = s->len, consumed, out_len;
+    enum qfile_step step;
+    int dst_fd, status;
+
+    remove_tree("dst");
+    assert(!mkdirat(base_fd, "dst", 0700));
+    dst_fd = openat(base_fd, "dst", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    assert(ctx && dst_fd >= 0);
+    if (s->existing)
+        write_file(dst_fd, s->existing, "old", 3, 0644);
+    qfile_ctx_set_dirfd(ctx, dst_fd);
+    qfile_ctx_set_unpack_features(ctx, ~0u);
+    qfile_ctx_set_unpack_threads(ctx, s->unpack_threads);
+    if (channel_fd >= 0)
+        qfile_ctx_set_unpack_channels(ctx, &channel_fd, 1);
+    assert(!qfile_ctx_start_unpack(ctx, COPY_ALLOW_DIRECTORIES));
+    for (;;) {
+        step = qfile_ctx_step(ctx, in_len ? in : NULL, in_len, &consumed);
+        in += consumed;
+        in_len -= consumed;
+        if (step == QFILE_STEP_OUTPUT) {
+            qfile_ctx_output(ctx, &out_len);
+            qfile_ctx_output_consumed(ctx, out_len);
+        } else if (step != QFILE_STEP_NEED_INPUT) {
+            break;
+        }
+    }
+    status = step == QFILE_STEP_DONE ? 0 : qfile_ctx_status(ctx);
+    qfile_ctx_free(ctx);
+    close(dst_fd);
+    return status;
+}
+
+static void test_malformed(void)
+{
+    struct qfile_extent extent = { 0, 100 };
+    struct qfile_ext_compress compress = { 0, 0 };
+    struct qfile_ext_stripe stripe = { 2, 0 };
+    struct qfile_stripe_frame frame;
+    struct file_header hdr;
+    struct stream s;
+    char name;
+    int channel[2], bad_channel[2];
+
+    assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel));
+
+    /* a valid one */
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_SPARSE);
+    add_entry(&s, S_IFDIR | 0755, "d", NULL, 0);
+    add_end(&s);
+    assert(unpack_stream(&s, -1) == 0);
+
+    /* hello not first, twice, or of a wrong size */
+    s = (struct stream){ .len = 0 };
+    add_entry(&s, S_IFDIR | 0755, "d", NULL, 0);
+    add_hello(&s, 0);
+    assert(unpack_stream(&s, -1) == EINVAL);
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, 0);
+    add_hello(&s, 0);
+    assert(unpack_stream(&s, -1) == EINVAL);
+    s = (struct stream){ .len = 0 };
+    add_ext(&s, QFILE_EXT_HELLO, "\0\0\0\0", 4);
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    /* extension records have an empty name */
+    s = (struct stream){ .len = 0 };
+    add_entry(&s, QFILE_S_IFEXT | QFILE_EXT_HELLO, "x", "\0\0\0\0\0\0\0\0", 8);
+    assert(unpack_stream(&s, -1) == EINVAL);
+    s = (struct stream){ .len = 0 };
+    hdr = (struct file_header){ .namelen = 1, .mode = QFILE_S_IFEXT | QFILE_EXT_HELLO,
+                                .filelen = 8 };
+    name = 'x';
+    add(&s, &hdr, sizeof(hdr));
+    add(&s, &name, 1);
+    add(&s, "\0\0\0\0\0\0\0\0", 8);
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    /* unknown record type */
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, 0);
+    add_ext(&s, 99, NULL, 0);
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    /* a feature that was not negotiated */
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, 0);
+    add_ext(&s, QFILE_EXT_SPARSE, &extent, sizeof(extent));
+    assert(unpack_stream(&s, -1) == EINVAL);
+    s = (struct stream){ .len = 0 };
+    add_ext(&s, QFILE_EXT_SPARSE, &extent, sizeof(extent));
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    /* extent map: partial extent, for a directory, past the end of file */
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_SPARSE);
+    add_ext(&s, QFILE_EXT_SPARSE, &extent, sizeof(extent) - 1);
+    assert(unpack_stream(&s, -1) == EINVAL);
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_SPARSE);
+    add_ext(&s, QFILE_EXT_SPARSE, &extent, sizeof(extent));
+    add_entry(&s, S_IFDIR | 0755, "d", NULL, 0);
+    assert(unpack_stream(&s, -1) == EINVAL);
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_SPARSE);
+    add_ext(&s, QFILE_EXT_SPARSE, &extent, sizeof(extent));
+    add_entry(&s, S_IFREG | 0644, "f", "0123456789", 10);
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    /* hard link: no terminating NUL, or followed by data */
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_HARDLINK);
+    add_ext(&s, QFILE_EXT_HARDLINK, "ab", 2);
+    assert(unpack_stream(&s, -1) == EINVAL);
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_HARDLINK);
+    add_entry(&s, S_IFREG | 0644, "a", "x", 1);
+    add_ext(&s, QFILE_EXT_HARDLINK, "a", 2);
+    add_entry(&s, S_IFREG | 0644, "b", "x", 1);
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    /* hard links only to files of the same transfer */
+    s = (struct stream){ .len = 0, .existing = "old" };
+    add_hello(&s, QFILE_FEATURE_HARDLINK);
+    add_entry(&s, S_IFREG | 0644, "a", "x", 1);
+    add_ext(&s, QFILE_EXT_HARDLINK, "a", 2);
+    add_entry(&s, S_IFREG | 0644, "b", NULL, 0);
+    add_end(&s);
+    assert(unpack_stream(&s, -1) == 0);
+    s = (struct stream){ .len = 0, .existing = "old" };
+    add_hello(&s, QFILE_FEATURE_HARDLINK);
+    add_ext(&s, QFILE_EXT_HARDLINK, "old", 4);
+    add_entry(&s, S_IFREG | 0644, "b", NULL, 0);
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    /* a file of the worker pool fails: nothing after it remains */
+    s = (struct stream){ .len = 0, .existing = "old", .unpack_threads = 4 };
+    add_hello(&s, 0);
+    add_entry(&s, S_IFREG | 0644, "a", "x", 1);
+    add_entry(&s, S_IFREG | 0644, "old", "x", 1);
+    for (name = 'b'; name <= 'z'; name++)
+        add_entry(&s, S_IFREG | 0644, (char[]){ name, '\0' }, "x", 1);
+    add_end(&s);
+    assert(unpack_stream(&s, -1) == EEXIST);
+    assert(!faccessat(base_fd, "dst/a", F_OK, AT_SYMLINK_NOFOLLOW));
+    for (name = 'b'; name <= 'z'; name++) {
+        char path[] = { 'd', 's', 't', '/', name, '\0' };
+        assert(faccessat(base_fd, path, F_OK, AT_SYMLINK_NOFOLLOW) && errno == ENOENT);
+    }
+
+    /* unknown codec */
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_ZSTD | QFILE_FEATURE_LZ4);
+    add_ext(&s, QFILE_EXT_COMPRESS, &compress, sizeof(compress));
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    /* more channels than the receiver has, or none */
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_STRIPE);
+    add_ext(&s, QFILE_EXT_STRIPE, &stripe, sizeof(stripe));
+    assert(unpack_stream(&s, channel[1]) == EINVAL);
+    stripe.channels = 0;
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_STRIPE);
+    add_ext(&s, QFILE_EXT_STRIPE, &stripe, sizeof(stripe));
+    assert(unpack_stream(&s, channel[1]) == EINVAL);
+
+    /* a bad frame on a channel: it is shut down, the sender does not block */
+    assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, bad_channel));
+    frame = (struct qfile_stripe_frame){ .seq = 1, .len = QFILE_STRIPE_CHUNK_SIZE };
+    assert(write(bad_channel[0], &frame, sizeof(frame)) == sizeof(frame));
+    stripe.channels = 1;
+    s = (struct stream){ .len = 0 };
+    add_hello(&s, QFILE_FEATURE_STRIPE);
+    add_ext(&s, QFILE_EXT_STRIPE, &stripe, sizeof(stripe));
+    hdr = (struct file_header){ .namelen = 2, .mode = S_IFREG | 0644,
+                                .filelen = 2 * QFILE_STRIPE_CHUNK_SIZE };
+    add(&s, &hdr, sizeof(hdr));
+    add(&s, "f", 2);
+    assert(unpack_stream(&s, bad_channel[1]) == EINVAL);
+    assert(send(bad_channel[0], &frame, sizeof(frame), MSG_NOSIGNAL) < 0 && errno == EPIPE);
+    close(bad_channel[0]);
+    close(bad_channel[1]);
+
+    /* invalid nanoseconds */
+    s = (struct stream){ .len = 0 };
+    hdr = (struct file_header){ .namelen = 2, .mode = S_IFREG | 0644, .mtime_nsec = 1000000000 };
+    add(&s, &hdr, sizeof(hdr));
+    add(&s, "f", 2);
+    add_end(&s);
+    assert(unpack_stream(&s, -1) == EINVAL);
+
+    close(channel[0]);
+    close(channel[1]);
+}
+
+int main(void)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    int src_fd;
+
+    snprintf(base, sizeof(base), "%s/qfile-test.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    assert(mkdtemp(base));
+    base_fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    assert(base_fd >= 0);
+    assert(!mkdirat(base_fd, "src", 0700) && !mkdirat(base_fd, "cache", 0700));
+    src_fd = openat(base_fd, "src", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    assert(src_fd >= 0);
+    srandom(1);
+    make_trees(src_fd);
+    close(src_fd);
+
+    test_features();
+    test_limits();
+    test_malformed();
+
+    remove_tree("");
+    return 0;
+}
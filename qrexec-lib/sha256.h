@@ -0,0 +1,21 @@
+#ifndef _SHA256_H
+#define _SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t count;
+    uint8_t buf[64];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+/* hash len bytes of fd from offset 0; returns 0 or -1 (errno set, EIO on short read) */
+int sha256_fd(int fd, unsigned long long len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif /* _SHA256_H */
@@ -0,0 +1,320 @@
+/*
+ * Striping of big regular files across data channels
+ * (QFILE_FEATURE_STRIPE).  Each channel is served by a thread of its own,
+ * which reads (or writes) the chunks of the file that belong to it at their
+ * offsets, so that checksumming and copying scale with the channels.  The
+ * stream only carries the headers.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "ioall.h"
+#include "crc32.h"
+#include "stripe.h"
+#include "ctx.h"
+
+void stripe_init(struct stripe *s)
+{
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->start, NULL);
+    pthread_cond_init(&s->done, NULL);
+}
+
+void stripe_destroy(struct stripe *s)
+{
+    stripe_stop(s);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->start);
+    pthread_cond_destroy(&s->done);
+}
+
+void stripe_set_fds(struct stripe *s, const int *fds, unsigned int count)
+{
+    unsigned int i;
+
+    if (count > QFILE_MAX_CHANNELS)
+        count = QFILE_MAX_CHANNELS;
+    for (i = 0; i < count; i++)
+        s->fds[i] = fds[i];
+    s->count = count;
+}
+
+/* returns the number of bytes read, less than len only on EOF */
+static ssize_t pread_all(int fd, char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = pread(fd, buf + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+    return done;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t offset)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return 0;
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 1;
+}
+
+static void add_progress(struct stripe *s, size_t len)
+{
+    pthread_mutex_lock(&s->lock);
+    s->progress += len;
+    pthread_cond_broadcast(&s->done);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int send_chunks(struct stripe *s, unsigned int index, char *buf)
+{
+    struct qfile_stripe_frame frame;
+    unsigned long long offset;
+    ssize_t len;
+
+    for (offset = (unsigned long long)index * QFILE_STRIPE_CHUNK_SIZE; offset < s->size;
+            offset += (unsigned long long)s->channels * QFILE_STRIPE_CHUNK_SIZE) {
+        frame.len = s->size - offset < QFILE_STRIPE_CHUNK_SIZE ?
+            s->size - offset : QFILE_STRIPE_CHUNK_SIZE;
+        len = pread_all(s->file_fd, buf, frame.len, offset);
+        if (len < 0)
+            return COPY_FILE_READ_ERROR;
+        /* the file got truncated meanwhile */
+        if ((size_t)len < frame.len)
+            return COPY_FILE_READ_EOF;
+        frame.seq = s->seq[index]++;
+        frame.offset = offset;
+        frame.crc32 = Crc32_ComputeBuf(0, buf, frame.len);
+        if (!write_all(s->fds[index], &frame, sizeof(frame)) ||
+                !write_all(s->fds[index], buf, frame.len))
+            return COPY_FILE_WRITE_ERROR;
+        add_progress(s, frame.len);
+    }
+    return COPY_FILE_OK;
+}
+
+/*
+ * After a failure to write the data, the rest of the frames is still read,
+ * so that the sender does not block on this channel.  A channel that cannot
+ * be read any further is shut down, for the sender's writes to fail.
+ */
+static int receive_chunks(struct stripe *s, unsigned int index, char *buf)
+{
+    struct qfile_stripe_frame untrusted_frame;
+    unsigned long long offset;
+    size_t len;
+    int status = COPY_FILE_OK, saved_errno = 0;
+
+    for (offset = (unsigned long long)index * QFILE_STRIPE_CHUNK_SIZE; offset < s->size;
+            offset += (unsigned long long)s->channels * QFILE_STRIPE_CHUNK_SIZE) {
+        len = s->size - offset < QFILE_STRIPE_CHUNK_SIZE ?
+            s->size - offset : QFILE_STRIPE_CHUNK_SIZE;
+        if (!read_all(s->fds[index], &untrusted_frame, sizeof(untrusted_frame)))
+            goto read_failed;
+        /* the layout is known, the header only confirms it */
+        if (untrusted_frame.seq != s->seq[index] || untrusted_frame.offset != offset ||
+                untrusted_frame.len != len) {
+            shutdown(s->fds[index], SHUT_RDWR);
+            errno = EINVAL;
+            return COPY_FILE_READ_ERROR;
+        }
+        s->seq[index]++;
+        if (!read_all(s->fds[index], buf, len))
+            goto read_failed;
+        if (status != COPY_FILE_OK)
+            continue;
+        if (Crc32_ComputeBuf(0, buf, len) != untrusted_frame.crc32) {
+            status = COPY_FILE_READ_ERROR;
+            saved_errno = EIO;
+        } else if (!pwrite_all(s->file_fd, buf, len, offset)) {
+            status = COPY_FILE_WRITE_ERROR;
+            saved_errno = errno;
+        } else {
+            add_progress(s, len);
+        }
+    }
+    errno = saved_errno;
+    return status;
+
+read_failed:
+    saved_errno = errno;
+    shutdown(s->fds[index], SHUT_RDWR);
+    errno = saved_errno;
+    return errno ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF;
+}
+
+static void *stripe_worker(void *arg)
+{
+    struct stripe_worker *w = arg;
+    struct stripe *s = w->s;
+    unsigned long generation = 0;
+    int status;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->stop && s->generation == generation)
+            pthread_cond_wait(&s->start, &s->lock);
+        if (s->stop)
+            break;
+        generation = s->generation;
+        pthread_mutex_unlock(&s->lock);
+        if (w->index >= s->channels)
+            status = COPY_FILE_OK;
+        else if (s->sending)
+            status = send_chunks(s, w->index, w->buf);
+        else
+            status = receive_chunks(s, w->index, w->buf);
+        pthread_mutex_lock(&s->lock);
+        if (status != COPY_FILE_OK && s->status == COPY_FILE_OK) {
+            s->status = status;
+            s->error = errno;
+        }
+        s->finished++;
+        pthread_cond_broadcast(&s->done);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int stripe_start(struct stripe *s)
+{
+    unsigned int i;
+    int ret;
+
+    if (s->nthreads)
+        return 0;
+    s->stop = 0;
+    s->generation = 0;
+    for (i = 0; i < s->count; i++) {
+        s->seq[i] = 0;
+        s->workers[i].s = s;
+        s->workers[i].index = i;
+        s->workers[i].buf = malloc(QFILE_STRIPE_CHUNK_SIZE);
+        if (!s->workers[i].buf) {
+            stripe_stop(s);
+            errno = ENOMEM;
+            return -1;
+        }
+        ret = pthread_create(&s->workers[i].thread, NULL, stripe_worker, &s->workers[i]);
+        if (ret) {
+            free(s->workers[i].buf);
+            s->workers[i].buf = NULL;
+            stripe_stop(s);
+            errno = ret;
+            return -1;
+        }
+        s->nthreads++;
+    }
+    return 0;
+}
+
+/* how often a sender checks the main stream for an error */
+#define STRIPE_POLL_MS 100
+
+/*
+ * Called with s->lock held, by a sender waiting for the channel threads.
+ * Returns 1 if the receiver wrote something (or went away) on in_fd.
+ */
+static int receiver_reported(struct stripe *s, int in_fd)
+{
+    struct pollfd pfd = { .fd = in_fd, .events = POLLIN };
+    struct timespec deadline;
+    int ret;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += STRIPE_POLL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&s->done, &s->lock, &deadline) != ETIMEDOUT)
+        return 0;
+    pthread_mutex_unlock(&s->lock);
+    ret = poll(&pfd, 1, 0);
+    pthread_mutex_lock(&s->lock);
+    return ret > 0;
+}
+
+int stripe_file(struct qfile_ctx *ctx, struct stripe *s, int sending, int fd,
+                unsigned long long size, unsigned int channels)
+{
+    unsigned long long progress;
+    /* a driven context has no fd to watch */
+    int watch_fd = sending ? ctx->in_fd : -1;
+    unsigned int i;
+    int status;
+
+    pthread_mutex_lock(&s->lock);
+    s->sending = sending;
+    s->file_fd = fd;
+    s->size = size;
+    s->channels = channels;
+    s->finished = 0;
+    s->progress = 0;
+    s->status = COPY_FILE_OK;
+    s->error = 0;
+    s->generation++;
+    pthread_cond_broadcast(&s->start);
+    /* progress is reported from this thread */
+    while (s->finished < s->nthreads || s->progress) {
+        if (s->progress) {
+            progress = s->progress;
+            s->progress = 0;
+            pthread_mutex_unlock(&s->lock);
+            qfile_notify_progress(ctx, progress, 0);
+            pthread_mutex_lock(&s->lock);
+            continue;
+        }
+        if (watch_fd < 0) {
+            pthread_cond_wait(&s->done, &s->lock);
+        } else if (receiver_reported(s, watch_fd)) {
+            /* the threads blocked in write() fail with EPIPE */
+            for (i = 0; i < channels; i++)
+                shutdown(s->fds[i], SHUT_RDWR);
+            watch_fd = -1;
+        }
+    }
+    status = s->status;
+    errno = s->error;
+    pthread_mutex_unlock(&s->lock);
+    return status;
+}
+
+void stripe_stop(struct stripe *s)
+{
+    unsigned int i;
+
+    if (!s->nthreads)
+        return;
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->nthreads; i++) {
+        pthread_join(s->workers[i].thread, NULL);
+        free(s->workers[i].buf);
+        s->workers[i].buf = NULL;
+    }
+    s->nthreads = 0;
+}
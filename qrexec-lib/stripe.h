@@ -0,0 +1,64 @@
+#ifndef _STRIPE_H
+#define _STRIPE_H
+
+#include <pthread.h>
+#include "libqubes-rpc-filecopy.h"
+
+struct stripe;
+
+struct stripe_worker {
+    struct stripe *s;
+    unsigned int index;
+    pthread_t thread;
+    /* a chunk, allocated by stripe_start() */
+    char *buf;
+};
+
+/* data channels of one transfer (QFILE_FEATURE_STRIPE) */
+struct stripe {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int fds[QFILE_MAX_CHANNELS];
+    unsigned int count;
+    /* a thread for each channel, while started */
+    struct stripe_worker workers[QFILE_MAX_CHANNELS];
+    unsigned int nthreads;
+    int stop;
+    /* next frame number on each channel */
+    uint64_t seq[QFILE_MAX_CHANNELS];
+    /* the file being transferred, a new generation for each */
+    unsigned long generation;
+    int sending;
+    int file_fd;
+    unsigned long long size;
+    unsigned int channels;
+    unsigned int finished;
+    /* bytes transferred, not reported yet */
+    unsigned long long progress;
+    /* first COPY_FILE_* failure and its errno */
+    int status;
+    int error;
+};
+
+void stripe_init(struct stripe *s);
+void stripe_destroy(struct stripe *s);
+/* the fds are not owned */
+void stripe_set_fds(struct stripe *s, const int *fds, unsigned int count);
+/*
+ * Start the threads, if not running; returns -1 (with errno) on error.
+ * Called during the negotiation, so that the feature can be dropped then.
+ */
+int stripe_start(struct stripe *s);
+/*
+ * Send the size bytes of fd over the first 'channels' channels, or receive
+ * them (pwrite() into fd).  Returns a COPY_FILE_* status, with errno set on
+ * failure.  When sending, the channels are shut down if anything arrives on
+ * ctx->in_fd meanwhile: the receiver reported an error and may not read them.
+ */
+int stripe_file(struct qfile_ctx *ctx, struct stripe *s, int sending, int fd,
+                unsigned long long size, unsigned int channels);
+/* stop the threads; the next transfer numbers the frames from 0 again */
+void stripe_stop(struct stripe *s);
+
+#endif /* _STRIPE_H */
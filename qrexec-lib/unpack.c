@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <stdlib.h>
@@ -11,300 +12,1877 @@
 #include <stdio.h>
 #include <limits.h>
 #include <assert.h>
-#include <err.h>
 #include <inttypes.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
 
 #include "libqubes-rpc-filecopy.h"
 #include "pure.h"
 #include "ioall.h"
 #include "crc32.h"
+#include "sha256.h"
+#include "compress.h"
+#include "stripe.h"
+#include "ctx.h"
+
+/*
+ * Resume journal: a JOURNAL_CREATED record right before an entry is created
+ * on disk (dropped again if that fails; after it, for directories, which are
+ * reused anyway), and JOURNAL_DONE when it is complete (with the stream
+ * checksum and the bytes received at that point).  Entries are processed
+ * one at a time, so only the last entry can be incomplete.  hdr.namelen is
+ * the length of the name that follows.
+ */
+enum journal_record_type { JOURNAL_CREATED = 1, JOURNAL_DONE = 2 };
+struct journal_record {
+    uint32_t type;
+    uint32_t crc32;
+    uint64_t total_bytes;
+    struct file_header hdr;
+};
+/*
+ * With incremental sync, writeback of each file is started as soon as it is
+ * written (and every WRITEBACK_CHUNK of a large file), and at the end only
+ * the files of this transfer are waited for, instead of syncfs().  Up to
+ * WRITEBACK_MAX_FILES are kept open for that; older ones are synced early.
+ */
+#define WRITEBACK_CHUNK (8 * 1024 * 1024)
+#define WRITEBACK_MAX_FILES 256
+/*
+ * With QFILE_FEATURE_DIR_ONCE, the final mode and times of directories are
+ * kept in dir_fixups (names in one buffer) and applied at the end of the
+ * stream.  The entries and the names together are capped.
+ */
+#define DIR_FIXUPS_MAX (64 * 1024 * 1024)
+/*
+ * With QFILE_FEATURE_HARDLINK, the regular files created by the transfer
+ * (also by an interrupted one that is resumed), so that link records can
+ * only alias them, not files that were in the directory before.  An open
+ * addressing table (ino 0 marks a free slot), capped.
+ */
+#define CREATED_INODES_MAX (128 * 1024 * 1024 / sizeof(struct created_inode))
+struct created_inode {
+    dev_t dev;
+    ino_t ino;
+};
+struct dir_fixup {
+    struct file_header hdr;
+    size_t name_offset;
+    unsigned int depth;
+};
+/*
+ * Files smaller than this are not preallocated; bigger ones at most this
+ * far ahead of the data received, so that a header alone cannot reserve
+ * much space.
+ */
+#define PREALLOC_MIN_SIZE (1024 * 1024)
+#define PREALLOC_AHEAD (64 * 1024 * 1024)
+
+/*
+ * Free space budget for wait_for_space(): queried with fstatvfs() only when
+ * it runs out (or gets stale), and reduced locally by the size of each file.
+ */
+#define SPACE_BUDGET_MAX_AGE_MS 1000
+#define SPACE_WAIT_MIN_DELAY_MS 10
+#define SPACE_WAIT_MAX_DELAY_MS 1000
+
+/*
+ * Input buffer, so that headers, names and small files don't each cost
+ * a read() call.  Data is checksummed when consumed from it.
+ */
+#define INBUF_SIZE (256 * 1024)
+/* file contents at least this big bypass the buffer (if empty) */
+#define INBUF_BYPASS_SIZE (64 * 1024)
+
+/*
+ * Cache of open directory fds for the parent directories of the last opened
+ * path, relative to the current directory.  The packer sends files in
+ * depth-first order, so consecutive files mostly share their parent
+ * directories.  Each entry is a prefix of the cached path (ending at a
+ * component boundary) and an fd for it; entries are nested.  With openat2()
+ * one entry may cover several components.  Only DIRCACHE_MAX_DEPTH entries
+ * are kept, deeper directories are opened for each file.
+ */
+#define DIRCACHE_MAX_DEPTH 64
+struct dircache {
+    /* path of the deepest cached directory */
+    char path[MAX_PATH_LENGTH];
+    /* length of the prefix of path each fd refers to */
+    size_t ends[DIRCACHE_MAX_DEPTH];
+    int fds[DIRCACHE_MAX_DEPTH];
+    int depth;
+    /* fd returned by opendir_safe() that is not cached, if any */
+    int uncached_fd;
+};
+
+/*
+ * Optional worker pool for small regular files: the main thread parses and
+ * validates the stream, reads the file data and queues the file; a worker
+ * creates, writes and finalizes it.  Only files in the same directory are in
+ * flight at once; any other entry waits for the queue to drain first, so
+ * directories are created and fixed up in stream order.  Results are
+ * retired in stream order, so the first failing entry is the one reported;
+ * once an item fails, no further items are started and the files created by
+ * the ones after it are removed again.
+ */
+#define WORK_QUEUE_SIZE 256
+#define WORK_MAX_FILE_SIZE (64 * 1024)
+#define MAX_UNPACK_THREADS 64
+
+enum work_state { WORK_FREE, WORK_QUEUED, WORK_RUNNING, WORK_DONE };
+
+struct unpack_work {
+    enum work_state state;
+    int dirfd;
+    /* dirfd is owned by this item (not from the directory cache) */
+    int close_dirfd;
+    char *name;
+    const char *last_segment;
+    char *data;
+    size_t len;
+    mode_t mode;
+    struct timespec times[2];
+    int use_tmpfile;
+    int keep_open;
+    int procdir_fd;
+    int record_inode;
+    /* stream CRC after the file data, reported if the item fails */
+    unsigned long crc32;
+    /* results */
+    int fd; /* if keep_open, to be passed to add_writeback() */
+    dev_t dev; /* if record_inode */
+    ino_t ino;
+    int error;
+    int tmpfile_unsupported;
+};
+
+struct work_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    pthread_t threads[MAX_UNPACK_THREADS];
+    int nthreads;
+    int stop;
+    /* an item failed, the ones not started yet are skipped */
+    int failed;
+    struct unpack_work items[WORK_QUEUE_SIZE];
+    /* oldest not retired, next to run, next free (monotonic counters) */
+    unsigned long head, next, tail;
+    /* parent directory of the queued files */
+    char parent[MAX_PATH_LENGTH];
+    size_t parent_len;
+};
+
+struct unpack_state {
+    char untrusted_namebuf[MAX_PATH_LENGTH];
+    unsigned long long bytes_limit;
+    unsigned long long files_limit;
+    unsigned long long total_bytes;
+    unsigned long long total_files;
+    int verbose;
+    /*
+     * If positive, wait for disk space before extracting a file,
+     * keeping this much extra space (in bytes).
+     */
+    unsigned long opt_wait_for_space_margin;
+    int use_tmpfile;
+    /* protocol extensions accepted if offered, and the ones actually in use */
+    uint32_t unpack_features;
+    uint32_t negotiated_features;
+    /* extent map for the next regular file, if sparse_count >= 0 */
+    struct qfile_extent untrusted_extents[QFILE_MAX_EXTENTS];
+    int sparse_count;
+    /* hard link target for the next regular file, if link_pending */
+    char untrusted_link_target[MAX_PATH_LENGTH];
+    int link_pending;
+    struct created_inode *created_inodes;
+    size_t created_inodes_count, created_inodes_size;
+    /* announced content of the next regular file, if hash_pending */
+    struct qfile_ext_hash untrusted_hash;
+    int hash_pending;
+    int hash_cache_fd;
+    /* codec of the next regular file, if compressed */
+    enum qfile_codec compress_pending;
+    char untrusted_block_buf[QFILE_BLOCK_SIZE];
+    char block_buf[QFILE_BLOCK_SIZE];
+    struct compress_state compress;
+    /* number of data channels the next regular file comes on, if striped */
+    unsigned int stripe_pending;
+    struct stripe stripe;
+    int journal_fd;
+    /* where the JOURNAL_CREATED record of the current entry starts */
+    off_t journal_created_offset;
+    int opt_incremental_sync;
+    int writeback_fds[WRITEBACK_MAX_FILES];
+    unsigned int writeback_head, writeback_count;
+    struct dir_fixup *dir_fixups;
+    size_t dir_fixups_count, dir_fixups_size;
+    char *dir_fixup_names;
+    size_t dir_fixup_names_len, dir_fixup_names_size;
+    int procdir_fd;
+
+    unsigned long long space_budget;
+    int space_budget_valid;
+    struct timespec space_budget_time;
+    /* in seconds, 0 - wait forever */
+    unsigned int opt_wait_for_space_timeout;
+
+    unsigned long crc32_sum;
+    char inbuf[INBUF_SIZE];
+    size_t inbuf_start, inbuf_end;
+
+    struct dircache dircache;
+    /* copies of names for opendir_safe() */
+    char path_buf[MAX_PATH_LENGTH];
+    char link_path_buf[MAX_PATH_LENGTH];
+    /* fd of the entry being processed, for unpack_abort() */
+    int entry_fd;
+    /* the file with space reserved past its end, and where that ends */
+    int prealloc_fd;
+    unsigned long long prealloc_end;
+    /* openat2() with RESOLVE_BENEATH available (probed in qfile_ctx_unpack()) */
+    int use_openat2;
+
+    int opt_unpack_threads;
+    struct work_queue work;
+};
+
+struct unpack_state default_unpack_state;
+
+void unpack_state_init(struct unpack_state *us)
+{
+    /* extensions widen what an untrusted sender can ask for: opt-in only */
+    us->unpack_features = 0;
+    us->sparse_count = -1;
+    us->hash_cache_fd = -1;
+    us->journal_fd = -1;
+    us->procdir_fd = -1;
+    us->dircache.uncached_fd = -1;
+    us->entry_fd = -1;
+    us->prealloc_fd = -1;
+    us->opt_unpack_threads = 1;
+    pthread_mutex_init(&us->work.lock, NULL);
+    pthread_cond_init(&us->work.queued, NULL);
+    pthread_cond_init(&us->work.done, NULL);
+    stripe_init(&us->stripe);
+}
+
+struct unpack_state *unpack_state_new(void)
+{
+    struct unpack_state *us = calloc(1, sizeof(*us));
+
+    if (us)
+        unpack_state_init(us);
+    return us;
+}
+
+void unpack_state_free(struct unpack_state *us)
+{
+    if (us->hash_cache_fd >= 0)
+        close(us->hash_cache_fd);
+    pthread_mutex_destroy(&us->work.lock);
+    pthread_cond_destroy(&us->work.queued);
+    pthread_cond_destroy(&us->work.done);
+    stripe_destroy(&us->stripe);
+    compress_state_free(&us->compress);
+    free(us->dir_fixups);
+    free(us->dir_fixup_names);
+    free(us->created_inodes);
+    free(us);
+}
+
+
+void send_status_and_crc(int code, const char *last_filename);
+static void send_result(struct qfile_ctx *ctx, int code, const char *last_filename);
+
+/* copy from asm-generic/fcntl.h */
+#ifndef __O_TMPFILE
+#define __O_TMPFILE 020000000
+#endif
+#ifndef O_TMPFILE
+/* a horrid kludge trying to make sure that this will fail on old kernels */
+#define O_TMPFILE (__O_TMPFILE | O_DIRECTORY)
+#define O_TMPFILE_MASK (__O_TMPFILE | O_DIRECTORY | O_CREAT)
+#endif
+
+/* free the space reserved past the end of a file that will not be completed */
+static void release_preallocation(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct stat st;
+
+    if (us->prealloc_fd < 0)
+        return;
+    if (fstat(us->prealloc_fd, &st) == 0 &&
+            us->prealloc_end > (unsigned long long)st.st_size)
+        fallocate(us->prealloc_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  st.st_size, us->prealloc_end - st.st_size);
+    us->prealloc_fd = -1;
+}
+
+static _Noreturn void do_exit(struct qfile_ctx *ctx, int code, const char *last_filename)
+{
+    release_preallocation(ctx);
+    qfile_set_error(ctx, "%s%s%s",
+                    code == LEGAL_EOF ? "Unexpected end of data" : strerror(code),
+                    last_filename ? "; Last file: " : "", last_filename ? last_filename : "");
+    close(ctx->in_fd);
+    send_result(ctx, code, last_filename);
+    qfile_exit(ctx, code);
+}
+
+void qfile_ctx_set_size_limit(struct qfile_ctx *ctx, unsigned long long new_bytes_limit, unsigned long long new_files_limit)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    us->bytes_limit = new_bytes_limit;
+    us->files_limit = new_files_limit;
+}
+
+void qfile_ctx_set_verbose(struct qfile_ctx *ctx, int value)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    us->verbose = value;
+}
+
+void qfile_ctx_set_wait_for_space(struct qfile_ctx *ctx, unsigned long value)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    us->opt_wait_for_space_margin = value;
+}
+
+void qfile_ctx_set_unpack_features(struct qfile_ctx *ctx, uint32_t features)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    us->unpack_features = features;
+}
+
+void qfile_ctx_set_unpack_channels(struct qfile_ctx *ctx, const int *fds, unsigned int count)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    stripe_set_fds(&us->stripe, fds, count);
+}
+
+void qfile_ctx_set_incremental_sync(struct qfile_ctx *ctx, int value)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    us->opt_incremental_sync = value;
+}
+
+void qfile_ctx_set_unpack_journal(struct qfile_ctx *ctx, int fd)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    us->journal_fd = fd;
+}
+
+int qfile_ctx_set_unpack_hash_cache(struct qfile_ctx *ctx, int dirfd, const char *source_qube)
+{
+    struct unpack_state *us = ctx->unpack;
+    int fd;
+
+    if (us->hash_cache_fd >= 0)
+        close(us->hash_cache_fd);
+    us->hash_cache_fd = -1;
+    if (dirfd < 0)
+        return 0;
+    if (qubes_pure_is_valid_qube_name(
+                qubes_pure_buffer_init_from_nul_terminated_string(source_qube)) != QUBE_NAME_OK) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mkdirat(dirfd, source_qube, 0700) && errno != EEXIST)
+        return -1;
+    fd = openat(dirfd, source_qube, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    us->hash_cache_fd = fd;
+    return 0;
+}
+
+void qfile_ctx_set_procfs_fd(struct qfile_ctx *ctx, int value)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    us->procdir_fd = value;
+    us->use_tmpfile = 1;
+}
+
+
+void qfile_ctx_set_wait_for_space_timeout(struct qfile_ctx *ctx, unsigned int seconds)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    us->opt_wait_for_space_timeout = seconds;
+}
+
+static long long ms_since(const struct timespec *t)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000LL +
+        (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static int query_space(struct qfile_ctx *ctx, int fd)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct statvfs fs_space;
+
+    if ((fd == AT_FDCWD ? statvfs(".", &fs_space) : fstatvfs(fd, &fs_space)) == -1) {
+        perror("fstatvfs");
+        return -1;
+    }
+    us->space_budget = (unsigned long long)fs_space.f_frsize * fs_space.f_bavail;
+    us->space_budget_valid = 1;
+    clock_gettime(CLOCK_MONOTONIC, &us->space_budget_time);
+    return 0;
+}
+
+/*
+ * Wait until there is space for a file of this size plus the margin, and
+ * account for it.  Returns 0 on success, an errno value otherwise.
+ */
+static int wait_for_space(struct qfile_ctx *ctx, int fd, unsigned long long filelen) {
+    struct unpack_state *us = ctx->unpack;
+    unsigned long long how_much = filelen + us->opt_wait_for_space_margin;
+    unsigned int delay_ms = SPACE_WAIT_MIN_DELAY_MS;
+    struct timespec start;
+
+    if (!us->space_budget_valid || us->space_budget < how_much ||
+            ms_since(&us->space_budget_time) > SPACE_BUDGET_MAX_AGE_MS) {
+        if (query_space(ctx, fd) < 0)
+            return errno;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (us->space_budget < how_much) {
+        if (us->opt_wait_for_space_timeout &&
+                ms_since(&start) >= us->opt_wait_for_space_timeout * 1000LL)
+            return ENOSPC;
+        usleep(delay_ms * 1000);
+        if (delay_ms < SPACE_WAIT_MAX_DELAY_MS)
+            delay_ms *= 2;
+        if (delay_ms > SPACE_WAIT_MAX_DELAY_MS)
+            delay_ms = SPACE_WAIT_MAX_DELAY_MS;
+        if (query_space(ctx, fd) < 0)
+            return errno;
+    }
+    us->space_budget -= filelen;
+    return 0;
+}
+
+/* refill the (empty) input buffer; on EOF returns 0 with errno = 0 */
+static int inbuf_fill(struct qfile_ctx *ctx, int fd)
+{
+    struct unpack_state *us = ctx->unpack;
+    ssize_t ret;
+
+    us->inbuf_start = us->inbuf_end = 0;
+    do {
+        ret = qfile_read(ctx, fd, us->inbuf, sizeof(us->inbuf));
+    } while (ret == -1 && errno == EINTR);
+    if (ret == 0) {
+        errno = 0;
+        fprintf(stderr, "EOF\n");
+        return 0;
+    }
+    if (ret < 0) {
+        if (errno != EAGAIN)
+            perror("read");
+        return 0;
+    }
+    us->inbuf_end = ret;
+    return 1;
+}
+
+static int read_all_with_crc(struct qfile_ctx *ctx, int fd, void *buf, int size) {
+    struct unpack_state *us = ctx->unpack;
+    char *out = buf;
+    size_t chunk;
+
+    while (size > 0) {
+        if (us->inbuf_start == us->inbuf_end && !inbuf_fill(ctx, fd))
+            return 0;
+        chunk = us->inbuf_end - us->inbuf_start;
+        if (chunk > (size_t)size)
+            chunk = size;
+        memcpy(out, us->inbuf + us->inbuf_start, chunk);
+        us->crc32_sum = Crc32_ComputeBuf(us->crc32_sum, us->inbuf + us->inbuf_start, chunk);
+        us->inbuf_start += chunk;
+        out += chunk;
+        size -= chunk;
+    }
+    return 1;
+}
+
+static void start_writeback(int fd)
+{
+    /* only a hint, errors are reported by the final fsync */
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+}
+
+/* wait for the data and metadata of the oldest file and close it */
+static int finish_writeback_one(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+    int fd = us->writeback_fds[us->writeback_head];
+    int ret = 0;
+
+    if (fsync(fd))
+        ret = errno;
+    close(fd);
+    us->writeback_head = (us->writeback_head + 1) % WRITEBACK_MAX_FILES;
+    us->writeback_count--;
+    return ret;
+}
+
+/* take ownership of a written file, to sync it at the end of transfer */
+static void add_writeback(struct qfile_ctx *ctx, int fd, const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    int ret;
+
+    start_writeback(fd);
+    if (us->writeback_count == WRITEBACK_MAX_FILES) {
+        ret = finish_writeback_one(ctx);
+        if (ret)
+            do_exit(ctx, ret, untrusted_name);
+    }
+    us->writeback_fds[(us->writeback_head + us->writeback_count) % WRITEBACK_MAX_FILES] = fd;
+    us->writeback_count++;
+}
+
+/*
+ * Wait for writeback of all the files first, so that the fsync() calls
+ * do not serialize on it; the first fsync() then usually commits the
+ * metadata of all of them (including directory entries) at once.
+ */
+static int finish_writeback(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+    unsigned int i;
+    int ret = 0, err;
+
+    for (i = 0; i < us->writeback_count; i++)
+        sync_file_range(us->writeback_fds[(us->writeback_head + i) % WRITEBACK_MAX_FILES], 0, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    while (us->writeback_count) {
+        err = finish_writeback_one(ctx);
+        if (err && !ret)
+            ret = err;
+    }
+    return ret;
+}
+
+/*
+ * Like copy_file(outfd, in_fd, ...), but consumes buffered input first.  Small
+ * files are read through the buffer too; big ones go straight to
+ * copy_file() once the buffer is drained.
+ */
+static int copy_file_with_inbuf(struct qfile_ctx *ctx, int outfd, long long size)
+{
+    struct unpack_state *us = ctx->unpack;
+    size_t chunk;
+
+    while (size > 0 &&
+            (us->inbuf_start < us->inbuf_end || size < INBUF_BYPASS_SIZE)) {
+        if (us->inbuf_start == us->inbuf_end && !inbuf_fill(ctx, ctx->in_fd))
+            return errno ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF;
+        chunk = us->inbuf_end - us->inbuf_start;
+        if ((long long)chunk > size)
+            chunk = size;
+        us->crc32_sum = Crc32_ComputeBuf(us->crc32_sum, us->inbuf + us->inbuf_start, chunk);
+        if (!write_all(outfd, us->inbuf + us->inbuf_start, chunk))
+            return COPY_FILE_WRITE_ERROR;
+        qfile_notify_progress(ctx, chunk, 0);
+        us->inbuf_start += chunk;
+        size -= chunk;
+    }
+    if (size > 0)
+        return copy_file_ctx(ctx, outfd, ctx->in_fd, size, &us->crc32_sum);
+    return COPY_FILE_OK;
+}
+
+static void send_result(struct qfile_ctx *ctx, int code, const char *last_filename)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct result_header hdr;
+    struct result_header_ext hdr_ext;
+    int saved_errno;
+
+    saved_errno = errno;
+    hdr.error_code = code;
+    hdr._pad = 0;
+    hdr.crc32 = us->crc32_sum;
+    if (!qfile_write_all(ctx, ctx->out_fd, &hdr, sizeof(hdr)))
+        perror("write status");
+    if (last_filename) {
+        hdr_ext.last_namelen = strlen(last_filename);
+        if (!qfile_write_all(ctx, ctx->out_fd, &hdr_ext, sizeof(hdr_ext)))
+            perror("write status ext");
+        if (!qfile_write_all(ctx, ctx->out_fd, last_filename, hdr_ext.last_namelen))
+            perror("write last_filename");
+    }
+    errno = saved_errno;
+}
+
+static long validate_utime_nsec(struct qfile_ctx *ctx, uint32_t untrusted_nsec,
+                                const char *untrusted_name)
+{
+    enum { MAX_NSEC = 999999999L };
+    if (untrusted_nsec > MAX_NSEC)
+        do_exit(ctx, EINVAL, untrusted_name);
+    return (long)untrusted_nsec;
+}
+
+static void get_times(struct qfile_ctx *ctx, const struct file_header *const untrusted_hdr,
+                      const char *untrusted_name, struct timespec times[2])
+{
+    times[0].tv_sec = untrusted_hdr->atime;
+    times[0].tv_nsec = validate_utime_nsec(ctx, untrusted_hdr->atime_nsec, untrusted_name);
+    times[1].tv_sec = untrusted_hdr->mtime;
+    times[1].tv_nsec = validate_utime_nsec(ctx, untrusted_hdr->mtime_nsec, untrusted_name);
+}
+
+static void fix_times_and_perms(struct qfile_ctx *ctx, const int fd,
+        const struct file_header *const untrusted_hdr,
+        const char *const untrusted_name)
+{
+    struct timespec times[2];
+
+    get_times(ctx, untrusted_hdr, untrusted_name, times);
+    /* Do not change the mode of symbolic links */
+    if (!S_ISLNK(untrusted_hdr->mode) &&
+            fchmod(fd, untrusted_hdr->mode & 07777))
+        do_exit(ctx, errno, untrusted_name);
+    if (futimens(fd, times))  /* as above */
+        do_exit(ctx, errno, untrusted_name);
+}
+
+static void dircache_truncate(struct qfile_ctx *ctx, int depth)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    while (us->dircache.depth > depth)
+        close(us->dircache.fds[--us->dircache.depth]);
+}
+
+/* cache fd for the first len bytes of parent */
+static void dircache_push(struct qfile_ctx *ctx, const char *parent, size_t len, int fd)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    memcpy(us->dircache.path, parent, len);
+    us->dircache.ends[us->dircache.depth] = len;
+    us->dircache.fds[us->dircache.depth] = fd;
+    us->dircache.depth++;
+}
+
+/* number of leading entries that are prefixes of parent */
+static int dircache_lookup(struct qfile_ctx *ctx, const char *parent, size_t parent_len)
+{
+    struct unpack_state *us = ctx->unpack;
+    int level;
+
+    for (level = 0; level < us->dircache.depth; level++) {
+        size_t len = us->dircache.ends[level];
+        if (len > parent_len ||
+                (len < parent_len && parent[len] != '/') ||
+                memcmp(us->dircache.path, parent, len) != 0)
+            break;
+    }
+    return level;
+}
+
+#ifdef SYS_openat2
+static int openat2_beneath(int dirfd, const char *path)
+{
+    struct open_how how = {
+        .flags = O_RDONLY | O_DIRECTORY | O_NOCTTY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd;
+
+    do {
+        fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+    } while (fd == -1 && (errno == EAGAIN || errno == EINTR));
+    return fd;
+}
+#endif
+
+static void probe_openat2(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+
+#ifdef SYS_openat2
+    int fd = openat2_beneath(ctx->dirfd, ".");
+    if (fd >= 0) {
+        close(fd);
+        us->use_openat2 = 1;
+        return;
+    }
+#endif
+    us->use_openat2 = 0;
+}
+
+/*
+ * Reserve disk space for the next len bytes at offset (at most
+ * PREALLOC_AHEAD), to get contiguous extents and to fail early if the file
+ * can't fit.  The file size is not changed; release_preallocation() frees
+ * what is left past the end if the transfer fails.  Returns 0 or an errno
+ * value.
+ */
+static int preallocate_file(struct qfile_ctx *ctx, int fd, unsigned long long offset,
+                            unsigned long long len)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    if (len < PREALLOC_MIN_SIZE)
+        return 0;
+    if (len > PREALLOC_AHEAD)
+        len = PREALLOC_AHEAD;
+    if (fd != us->prealloc_fd) {
+        us->prealloc_fd = fd;
+        us->prealloc_end = 0;
+    }
+    if (offset + len > us->prealloc_end)
+        us->prealloc_end = offset + len;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len) == 0)
+        return 0;
+    if (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)
+        return errno;
+    /* not supported by the filesystem, or other non-fatal failure */
+    return 0;
+}
+
+// Open the second-to-last component of a path, enforcing O_NOFOLLOW for every
+// path component.  *last_segment will be set to the last segment of the path,
+// and points into the original path.  The original path is modified in-place,
+// so one should probably pass a copy.  The return value is either dirfd (if the
+// path has no / in it) or a file descriptor that must be released with
+// closedir_safe().  The directory cache is used only if dirfd is the
+// directory of the transfer (ctx->dirfd).
+static int opendir_safe(struct qfile_ctx *ctx, int dirfd, char *path, const char **last_segment)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    assert(path && *path); // empty paths rejected earlier
+    assert(us->dircache.uncached_fd == -1);
+    char *this_segment = path, *next_segment = NULL;
+    char *last_slash = strrchr(path, '/');
+    size_t parent_len = last_slash ? (size_t)(last_slash - path) : 0;
+    int use_cache = (dirfd == ctx->dirfd);
+    int cur_fd = dirfd;
+    int level = 0;
+
+    *last_segment = last_slash ? last_slash + 1 : path;
+    if (!last_slash)
+        return dirfd;
+    for (char *p = path;; p = next_segment) {
+        char *next = strchr(p, '/');
+        if (next == NULL)
+            break;
+        next_segment = next + 1;
+        if ((next - p <= 2) &&
+            (memcmp(p, "..", (size_t)(next - p)) == 0)) {
+            fprintf(stderr, "BUG: path component '%.*s' not rejected earlier!\n", (int)(next - p), p);
+            abort();
+        }
+    }
+
+    if (use_cache) {
+        level = dircache_lookup(ctx, path, parent_len);
+        dircache_truncate(ctx, level);
+        if (level) {
+            cur_fd = us->dircache.fds[level - 1];
+            if (us->dircache.ends[level - 1] == parent_len)
+                return cur_fd;
+            this_segment = path + us->dircache.ends[level - 1] + 1;
+        }
+    }
+    *last_slash = '\0';
+
+#ifdef SYS_openat2
+    /* all the remaining components in one go */
+    if (us->use_openat2) {
+        int new_fd = openat2_beneath(cur_fd, this_segment);
+        if (new_fd >= 0) {
+            if (use_cache && level < DIRCACHE_MAX_DEPTH)
+                dircache_push(ctx, path, parent_len, new_fd);
+            else
+                us->dircache.uncached_fd = new_fd;
+            return new_fd;
+        }
+        /* retry the walk below, to fail the same way as without openat2 */
+    }
+#endif
+
+    for (;;this_segment = next_segment, level++) {
+        assert(this_segment);
+        char *next = strchr(this_segment, '/');
+        if (next != NULL) {
+            *next = '\0';
+            next_segment = next + 1;
+        }
+        int new_fd = openat(cur_fd, this_segment, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+        if (new_fd == -1)
+            do_exit(ctx, errno, this_segment);
+        if (use_cache && level < DIRCACHE_MAX_DEPTH) {
+            dircache_push(ctx, path, this_segment + strlen(this_segment) - path, new_fd);
+        } else if (cur_fd != dirfd && (!use_cache || level > DIRCACHE_MAX_DEPTH)) {
+            close(cur_fd);
+        }
+        cur_fd = new_fd;
+        if (next == NULL)
+            break;
+        /* keep the cached path joined with '/' */
+        *next = '/';
+    }
+    if (!use_cache || level >= DIRCACHE_MAX_DEPTH)
+        us->dircache.uncached_fd = cur_fd;
+    return cur_fd;
+}
+
+static void closedir_safe(struct qfile_ctx *ctx, int fd)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    if (fd == us->dircache.uncached_fd) {
+        close(fd);
+        us->dircache.uncached_fd = -1;
+    }
+}
+
+/* a modifiable copy of a name for opendir_safe(), in buf */
+static char *path_copy(struct qfile_ctx *ctx, char buf[MAX_PATH_LENGTH], const char *untrusted_name)
+{
+    size_t len = strlen(untrusted_name);
+
+    if (len >= MAX_PATH_LENGTH)
+        do_exit(ctx, ENAMETOOLONG, untrusted_name);
+    return memcpy(buf, untrusted_name, len + 1);
+}
+
+void qfile_ctx_set_unpack_threads(struct qfile_ctx *ctx, int value)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    if (value > MAX_UNPACK_THREADS)
+        value = MAX_UNPACK_THREADS;
+    us->opt_unpack_threads = value;
+}
+
+static size_t created_inode_slot(struct created_inode *table, size_t size,
+                                 dev_t dev, ino_t ino)
+{
+    size_t i = (size_t)((dev * 0x9e3779b97f4a7c15ULL) ^ ino) * 0x9e3779b97f4a7c15ULL;
+
+    for (i &= size - 1; table[i].ino; i = (i + 1) & (size - 1))
+        if (table[i].dev == dev && table[i].ino == ino)
+            break;
+    return i;
+}
+
+static void record_created_inode(struct qfile_ctx *ctx, dev_t dev, ino_t ino,
+                                 const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct created_inode *entry;
+    size_t i;
+
+    if (!ino)
+        return;
+    if (us->created_inodes_count >= us->created_inodes_size / 2) {
+        size_t new_size = us->created_inodes_size ? us->created_inodes_size * 2 : 256;
+        struct created_inode *table;
+        if (new_size > CREATED_INODES_MAX)
+            do_exit(ctx, ENOMEM, untrusted_name);
+        if ((table = calloc(new_size, sizeof(*table))) == NULL)
+            do_exit(ctx, ENOMEM, untrusted_name);
+        for (i = 0; i < us->created_inodes_size; i++) {
+            if (!us->created_inodes[i].ino)
+                continue;
+            table[created_inode_slot(table, new_size, us->created_inodes[i].dev,
+                                     us->created_inodes[i].ino)] = us->created_inodes[i];
+        }
+        free(us->created_inodes);
+        us->created_inodes = table;
+        us->created_inodes_size = new_size;
+    }
+    entry = &us->created_inodes[created_inode_slot(us->created_inodes, us->created_inodes_size,
+                                                   dev, ino)];
+    if (entry->ino)
+        return;
+    entry->dev = dev;
+    entry->ino = ino;
+    us->created_inodes_count++;
+}
+
+static int is_created_inode(struct qfile_ctx *ctx, const struct stat *st)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    return us->created_inodes_size && st->st_ino &&
+        us->created_inodes[created_inode_slot(us->created_inodes, us->created_inodes_size,
+                                              st->st_dev, st->st_ino)].ino;
+}
+
+/* the regular file open as fd was created by this transfer */
+static void record_created_file(struct qfile_ctx *ctx, int fd, const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct stat st;
+
+    if (!(us->negotiated_features & QFILE_FEATURE_HARDLINK))
+        return;
+    if (fstat(fd, &st))
+        do_exit(ctx, errno, untrusted_name);
+    record_created_inode(ctx, st.st_dev, st.st_ino, untrusted_name);
+}
+
+/* runs on a worker thread; must not call do_exit() */
+static void write_queued_file(struct unpack_work *w)
+{
+    int fdout = -1;
+
+    if (w->use_tmpfile) {
+        fdout = openat(w->dirfd, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC | O_NOCTTY, 0700);
+        if (fdout < 0) {
+            if (errno != ENOENT && errno != EOPNOTSUPP)
+                goto fail;
+            w->tmpfile_unsupported = 1;
+            w->use_tmpfile = 0;
+        }
+    }
+    if (fdout < 0)
+        fdout = openat(w->dirfd, w->last_segment, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY, 0000);
+    if (fdout < 0)
+        goto fail;
+    if (!write_all(fdout, w->data, w->len))
+        goto fail;
+    if (w->use_tmpfile) {
+        char fd_str[11];
+        if ((unsigned)snprintf(fd_str, sizeof(fd_str), "%d", fdout) >= sizeof(fd_str))
+            abort();
+        if (linkat(w->procdir_fd, fd_str, w->dirfd, w->last_segment, AT_SYMLINK_FOLLOW) < 0)
+            goto fail;
+    }
+    if (fchmod(fdout, w->mode & 07777) || futimens(fdout, w->times))
+        goto fail;
+    if (w->record_inode) {
+        struct stat st;
+
+        if (fstat(fdout, &st))
+            goto fail;
+        w->dev = st.st_dev;
+        w->ino = st.st_ino;
+    }
+    if (w->keep_open) {
+        w->fd = fdout;
+        return;
+    }
+    close(fdout);
+    return;
+fail:
+    w->error = errno ? errno : EIO;
+    if (fdout >= 0)
+        close(fdout);
+}
+
+static void *unpack_worker(void *arg)
+{
+    struct work_queue *work = arg;
+    struct unpack_work *w;
+
+    pthread_mutex_lock(&work->lock);
+    for (;;) {
+        while (!work->stop && work->next == work->tail)
+            pthread_cond_wait(&work->queued, &work->lock);
+        if (work->next == work->tail)
+            break;
+        w = &work->items[work->next++ % WORK_QUEUE_SIZE];
+        if (work->failed) {
+            w->error = ECANCELED;
+            w->state = WORK_DONE;
+            pthread_cond_broadcast(&work->done);
+            continue;
+        }
+        w->state = WORK_RUNNING;
+        pthread_mutex_unlock(&work->lock);
+        write_queued_file(w);
+        pthread_mutex_lock(&work->lock);
+        if (w->error)
+            work->failed = 1;
+        w->state = WORK_DONE;
+        pthread_cond_broadcast(&work->done);
+    }
+    pthread_mutex_unlock(&work->lock);
+    return NULL;
+}
+
+/*
+ * Called with work.lock held, when the oldest item failed: wait for the
+ * items still running, and remove the files created after the failing one.
+ */
+static void undo_later_work(struct unpack_state *us)
+{
+    struct unpack_work *w;
+    unsigned long i;
+
+    for (i = us->work.head + 1; i != us->work.next; i++) {
+        w = &us->work.items[i % WORK_QUEUE_SIZE];
+        while (w->state == WORK_RUNNING)
+            pthread_cond_wait(&us->work.done, &us->work.lock);
+        if (!w->error)
+            unlinkat(w->dirfd, w->last_segment, 0);
+    }
+}
+
+/* called with work.lock held; reports a failure of the oldest item */
+static void retire_work(struct qfile_ctx *ctx, struct unpack_work *w)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    if (w->tmpfile_unsupported)
+        us->use_tmpfile = 0;
+    if (w->close_dirfd)
+        close(w->dirfd);
+    w->close_dirfd = 0;
+    free(w->data);
+    w->data = NULL;
+    if (w->error) {
+        undo_later_work(us);
+        pthread_mutex_unlock(&us->work.lock);
+        us->crc32_sum = w->crc32;
+        do_exit(ctx, w->error, w->name);
+    }
+    if (w->record_inode) {
+        pthread_mutex_unlock(&us->work.lock);
+        record_created_inode(ctx, w->dev, w->ino, w->name);
+        pthread_mutex_lock(&us->work.lock);
+    }
+    if (w->fd >= 0) {
+        pthread_mutex_unlock(&us->work.lock);
+        add_writeback(ctx, w->fd, w->name);
+        w->fd = -1;
+        pthread_mutex_lock(&us->work.lock);
+    }
+    free(w->name);
+    w->name = NULL;
+    w->state = WORK_FREE;
+    us->work.head++;
+}
+
+/*
+ * Wait until the queue has at most 'keep' items, retiring finished ones.
+ * After a failure it drains the queue, until the failing item is reported.
+ */
+static void wait_for_work(struct qfile_ctx *ctx, unsigned long keep)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    pthread_mutex_lock(&us->work.lock);
+    while (us->work.tail - us->work.head > (us->work.failed ? 0 : keep)) {
+        struct unpack_work *w = &us->work.items[us->work.head % WORK_QUEUE_SIZE];
+        if (w->state == WORK_DONE)
+            retire_work(ctx, w);
+        else
+            pthread_cond_wait(&us->work.done, &us->work.lock);
+    }
+    pthread_mutex_unlock(&us->work.lock);
+}
+
+static void drain_work(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    if (us->work.nthreads)
+        wait_for_work(ctx, 0);
+    us->work.parent_len = 0;
+}
+
+static void start_workers(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+    int i;
+
+    us->work.head = us->work.next = us->work.tail = 0;
+    us->work.stop = 0;
+    us->work.failed = 0;
+    us->work.parent_len = 0;
+    us->work.nthreads = 0;
+    /* the journal needs the entries completed in order */
+    if (us->opt_unpack_threads <= 1 || us->journal_fd >= 0)
+        return;
+    for (i = 0; i < us->opt_unpack_threads; i++) {
+        if (pthread_create(&us->work.threads[i], NULL, unpack_worker, &us->work))
+            break;
+        us->work.nthreads++;
+    }
+}
+
+static void stop_workers(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+    int i;
+
+    if (!us->work.nthreads)
+        return;
+    drain_work(ctx);
+    pthread_mutex_lock(&us->work.lock);
+    us->work.stop = 1;
+    pthread_cond_broadcast(&us->work.queued);
+    pthread_mutex_unlock(&us->work.lock);
+    for (i = 0; i < us->work.nthreads; i++)
+        pthread_join(us->work.threads[i], NULL);
+    us->work.nthreads = 0;
+}
+
+static int can_queue_file(struct qfile_ctx *ctx, const struct file_header *untrusted_hdr)
+{
+    struct unpack_state *us = ctx->unpack;
+
+    return us->work.nthreads && S_ISREG(untrusted_hdr->mode) && !us->link_pending &&
+        !us->hash_pending && !us->compress_pending && !us->stripe_pending &&
+        us->sparse_count < 0 &&
+        untrusted_hdr->filelen <= WORK_MAX_FILE_SIZE;
+}
+
+/* process_one_file_reg() for a file handed over to the worker pool */
+static void queue_file(struct qfile_ctx *ctx, const struct file_header *untrusted_hdr,
+                       const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    const char *last_slash = strrchr(untrusted_name, '/');
+    size_t parent_len = last_slash ? (size_t)(last_slash - untrusted_name) : 0;
+    unsigned long long filelen = untrusted_hdr->filelen; /* small, checked by caller */
+    struct unpack_work *w;
+    char *path_dup;
+    int ret;
+
+    /* a failure of a file in flight is reported before this one */
+    wait_for_work(ctx, WORK_QUEUE_SIZE);
+    /* same limits as in process_one_file_reg(), before anything is allocated */
+    if (us->bytes_limit && filelen > us->bytes_limit)
+        do_exit(ctx, EDQUOT, untrusted_name);
+    if (us->bytes_limit && us->total_bytes > us->bytes_limit - filelen)
+        do_exit(ctx, EDQUOT, untrusted_name);
+
+    /* the cached fds of other directories may be closed below */
+    if (parent_len != us->work.parent_len ||
+            memcmp(us->work.parent, untrusted_name, parent_len) != 0) {
+        drain_work(ctx);
+        memcpy(us->work.parent, untrusted_name, parent_len);
+        us->work.parent_len = parent_len;
+    }
+    wait_for_work(ctx, WORK_QUEUE_SIZE - 1);
+    w = &us->work.items[us->work.tail % WORK_QUEUE_SIZE];
+    memset(w, 0, sizeof(*w));
+
+    w->fd = -1;
+    if ((w->name = strdup(untrusted_name)) == NULL)
+        do_exit(ctx, ENOMEM, untrusted_name);
+    path_dup = path_copy(ctx, us->path_buf, untrusted_name);
+    w->dirfd = opendir_safe(ctx, ctx->dirfd, path_dup, &w->last_segment);
+    w->procdir_fd = us->procdir_fd;
+    /* point into our own copy, path_dup is only needed for opendir_safe */
+    w->last_segment = w->name + (w->last_segment - path_dup);
+    if (us->dircache.uncached_fd == w->dirfd) {
+        w->close_dirfd = 1;
+        us->dircache.uncached_fd = -1;
+    }
+
+    if (us->opt_wait_for_space_margin) {
+        ret = wait_for_space(ctx, w->dirfd, filelen);
+        if (ret)
+            do_exit(ctx, ret, untrusted_name);
+    }
+    us->total_bytes += filelen;
+    if ((w->data = malloc(filelen ? filelen : 1)) == NULL)
+        do_exit(ctx, ENOMEM, untrusted_name);
+    if (!read_all_with_crc(ctx, ctx->in_fd, w->data, filelen))
+        do_exit(ctx, LEGAL_EOF, untrusted_name); // hopefully remote will produce error message
+    qfile_notify_progress(ctx, filelen, 0);
+    w->crc32 = us->crc32_sum;
+    w->len = filelen;
+    w->mode = untrusted_hdr->mode;
+    get_times(ctx, untrusted_hdr, untrusted_name, w->times);
+    w->use_tmpfile = us->use_tmpfile;
+    w->keep_open = us->opt_incremental_sync;
+    w->record_inode = !!(us->negotiated_features & QFILE_FEATURE_HARDLINK);
+
+    pthread_mutex_lock(&us->work.lock);
+    w->state = WORK_QUEUED;
+    us->work.tail++;
+    pthread_cond_signal(&us->work.queued);
+    pthread_mutex_unlock(&us->work.lock);
+}
+
+static void receive_data(struct qfile_ctx *ctx, int fdout, unsigned long long len,
+                         const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    unsigned long long chunk;
+    off_t offset = 0;
+    int ret;
+
+    if (len >= PREALLOC_MIN_SIZE && (offset = lseek(fdout, 0, SEEK_CUR)) < 0)
+        do_exit(ctx, errno, untrusted_name);
+    do {
+        chunk = len;
+        if (us->opt_incremental_sync && chunk > WRITEBACK_CHUNK)
+            chunk = WRITEBACK_CHUNK;
+        /* keep the reservation ahead of the data */
+        if (chunk > PREALLOC_AHEAD / 2)
+            chunk = PREALLOC_AHEAD / 2;
+        ret = preallocate_file(ctx, fdout, offset, len);
+        if (ret)
+            do_exit(ctx, ret, untrusted_name);
+        ret = copy_file_with_inbuf(ctx, fdout, chunk);
+        if (ret != COPY_FILE_OK)
+            break;
+        len -= chunk;
+        offset += chunk;
+        if (us->opt_incremental_sync && len)
+            start_writeback(fdout);
+    } while (len);
+    if (ret != COPY_FILE_OK) {
+        if (ret == COPY_FILE_READ_EOF
+                || ret == COPY_FILE_READ_ERROR)
+            do_exit(ctx, LEGAL_EOF, untrusted_name); // hopefully remote will produce error message
+        else
+            do_exit(ctx, errno, untrusted_name);
+    }
+}
+
+/* read compressed blocks, write their data */
+static void receive_compressed_data(struct qfile_ctx *ctx, int fdout, unsigned long long filelen,
+                                    const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct qfile_block untrusted_block;
+    unsigned long long since_writeback = 0;
+    uint32_t raw_len, stored_len;
+
+    while (filelen) {
+        if (!read_all_with_crc(ctx, ctx->in_fd, &untrusted_block, sizeof(untrusted_block)))
+            do_exit(ctx, LEGAL_EOF, untrusted_name); // hopefully remote will produce error message
+        raw_len = filelen < QFILE_BLOCK_SIZE ? filelen : QFILE_BLOCK_SIZE;
+        if (untrusted_block.raw_len != raw_len ||
+                untrusted_block.stored_len == 0 ||
+                untrusted_block.stored_len > raw_len)
+            do_exit(ctx, EINVAL, untrusted_name);
+        stored_len = untrusted_block.stored_len;
+        if (!read_all_with_crc(ctx, ctx->in_fd, us->untrusted_block_buf, stored_len))
+            do_exit(ctx, LEGAL_EOF, untrusted_name);
+        if (stored_len == raw_len) {
+            if (!write_all(fdout, us->untrusted_block_buf, raw_len))
+                do_exit(ctx, errno, untrusted_name);
+        } else {
+            if (decompress_block(&us->compress, us->compress_pending, us->block_buf, raw_len,
+                                 us->untrusted_block_buf, stored_len))
+                do_exit(ctx, EINVAL, untrusted_name);
+            if (!write_all(fdout, us->block_buf, raw_len))
+                do_exit(ctx, errno, untrusted_name);
+        }
+        qfile_notify_progress(ctx, raw_len, 0);
+        filelen -= raw_len;
+        since_writeback += raw_len;
+        if (us->opt_incremental_sync && filelen && since_writeback >= WRITEBACK_CHUNK) {
+            start_writeback(fdout);
+            since_writeback = 0;
+        }
+    }
+    us->compress_pending = 0;
+}
+
+static void receive_striped_data(struct qfile_ctx *ctx, int fdout, unsigned long long filelen,
+                                 const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    int ret;
+
+    if (stripe_start(&us->stripe) < 0)
+        do_exit(ctx, errno, untrusted_name);
+    ret = stripe_file(ctx, &us->stripe, 0, fdout, filelen, us->stripe_pending);
+    if (ret == COPY_FILE_READ_EOF)
+        do_exit(ctx, LEGAL_EOF, untrusted_name); // hopefully remote will produce error message
+    if (ret != COPY_FILE_OK)
+        do_exit(ctx, errno ? errno : EIO, untrusted_name);
+    us->stripe_pending = 0;
+}
+
+/*
+ * Check the pending extent map against the file size: extents must be
+ * non-empty, sorted, non-overlapping and within the file.  Returns the
+ * total data length.
+ */
+static unsigned long long validate_extents(struct qfile_ctx *ctx, unsigned long long filelen,
+                                           const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    unsigned long long data_len = 0, end = 0;
+    int i;
+
+    for (i = 0; i < us->sparse_count; i++) {
+        unsigned long long untrusted_offset = us->untrusted_extents[i].offset;
+        unsigned long long untrusted_length = us->untrusted_extents[i].length;
+        if (untrusted_length == 0 || untrusted_offset < end ||
+                untrusted_offset > filelen ||
+                untrusted_length > filelen - untrusted_offset)
+            do_exit(ctx, EINVAL, untrusted_name);
+        end = untrusted_offset + untrusted_length;
+        data_len += untrusted_length;
+    }
+    return data_len;
+}
+
+/* write the data extents at their offsets, leaving holes in between */
+static void receive_sparse_data(struct qfile_ctx *ctx, int fdout, unsigned long long filelen,
+                                const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    int i;
+
+    for (i = 0; i < us->sparse_count; i++) {
+        /* validated by validate_extents() */
+        off_t offset = us->untrusted_extents[i].offset;
+        unsigned long long len = us->untrusted_extents[i].length;
+        if (lseek(fdout, offset, SEEK_SET) < 0)
+            do_exit(ctx, errno, untrusted_name);
+        receive_data(ctx, fdout, len, untrusted_name);
+    }
+    if (ftruncate(fdout, filelen))
+        do_exit(ctx, errno, untrusted_name);
+    us->sparse_count = -1;
+}
+
+static void journal_write(struct qfile_ctx *ctx, enum journal_record_type type,
+                          const struct file_header *untrusted_hdr,
+                          const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct journal_record rec;
+    size_t namelen = strlen(untrusted_name) + 1;
+
+    if (us->journal_fd < 0)
+        return;
+    rec.type = type;
+    rec.crc32 = us->crc32_sum;
+    rec.total_bytes = us->total_bytes;
+    rec.hdr = *untrusted_hdr;
+    rec.hdr.namelen = namelen;
+    if (!write_all(us->journal_fd, &rec, sizeof(rec)) ||
+            !write_all(us->journal_fd, untrusted_name, namelen))
+        do_exit(ctx, errno, untrusted_name);
+}
 
-static char untrusted_namebuf[MAX_PATH_LENGTH];
-static unsigned long long bytes_limit = 0;
-static unsigned long long files_limit = 0;
-static unsigned long long total_bytes = 0;
-static unsigned long long total_files = 0;
-static int verbose = 0;
 /*
- * If positive, wait for disk space before extracting a file,
- * keeping this much extra space (in bytes).
+ * Journal the entry before creating it: if interrupted right after that, the
+ * resumed transfer removes it instead of failing on it with EEXIST.  The
+ * name must not be taken yet, so that nothing else is ever removed.
  */
-static unsigned long opt_wait_for_space_margin;
-static int use_tmpfile = 0;
-static int procdir_fd = -1;
-
-void send_status_and_crc(int code, const char *last_filename);
+static void journal_created(struct qfile_ctx *ctx, int safe_dirfd, const char *last_segment,
+                            const struct file_header *untrusted_hdr,
+                            const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct stat buf;
 
-/* copy from asm-generic/fcntl.h */
-#ifndef __O_TMPFILE
-#define __O_TMPFILE 020000000
-#endif
-#ifndef O_TMPFILE
-/* a horrid kludge trying to make sure that this will fail on old kernels */
-#define O_TMPFILE (__O_TMPFILE | O_DIRECTORY)
-#define O_TMPFILE_MASK (__O_TMPFILE | O_DIRECTORY | O_CREAT)
-#endif
+    if (us->journal_fd < 0)
+        return;
+    if (fstatat(safe_dirfd, last_segment, &buf, AT_SYMLINK_NOFOLLOW) == 0)
+        do_exit(ctx, EEXIST, untrusted_name);
+    if (errno != ENOENT)
+        do_exit(ctx, errno, untrusted_name);
+    us->journal_created_offset = lseek(us->journal_fd, 0, SEEK_CUR);
+    if (us->journal_created_offset < 0)
+        do_exit(ctx, errno, untrusted_name);
+    journal_write(ctx, JOURNAL_CREATED, untrusted_hdr, untrusted_name);
+}
 
-static _Noreturn void do_exit(int code, const char *last_filename)
+/* creating the entry failed, drop its JOURNAL_CREATED record; keeps errno */
+static void journal_not_created(struct qfile_ctx *ctx)
 {
-    close(0);
-    send_status_and_crc(code, last_filename);
-    exit(code);
+    struct unpack_state *us = ctx->unpack;
+    int saved_errno = errno;
+
+    if (us->journal_fd >= 0 &&
+            (ftruncate(us->journal_fd, us->journal_created_offset) ||
+             lseek(us->journal_fd, us->journal_created_offset, SEEK_SET) < 0))
+        do_exit(ctx, errno, NULL);
+    errno = saved_errno;
 }
 
-void set_size_limit(unsigned long long new_bytes_limit, unsigned long long new_files_limit)
+static void journal_reset(struct qfile_ctx *ctx)
 {
-    bytes_limit = new_bytes_limit;
-    files_limit = new_files_limit;
+    struct unpack_state *us = ctx->unpack;
+
+    if (us->journal_fd >= 0 &&
+            (ftruncate(us->journal_fd, 0) || lseek(us->journal_fd, 0, SEEK_SET) < 0))
+        do_exit(ctx, errno, NULL);
 }
 
-void set_verbose(int value)
+static void hash_to_name(const uint8_t *hash, char name[2 * SHA256_DIGEST_SIZE + 1])
 {
-    verbose = value;
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        name[2 * i] = hex[hash[i] >> 4];
+        name[2 * i + 1] = hex[hash[i] & 15];
+    }
+    name[2 * SHA256_DIGEST_SIZE] = 0;
 }
 
-void set_wait_for_space(unsigned long value)
+static int has_hash(int fd, unsigned long long len, const uint8_t *hash)
 {
-    opt_wait_for_space_margin = value;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    return sha256_fd(fd, len, digest) == 0 &&
+        memcmp(digest, hash, SHA256_DIGEST_SIZE) == 0;
 }
 
-void set_procfs_fd(int value)
+/*
+ * Copy the first len bytes of fdin to the (empty) fdout: a reflink if the
+ * filesystem can, copy_file_range() or plain reads and writes otherwise.
+ * The file positions are not used.  Returns 1 on success.
+ */
+static int copy_contents(int fdin, int fdout, unsigned long long len)
 {
-    procdir_fd = value;
-    use_tmpfile = 1;
-}
+    char buf[64 * 1024];
+    off_t in_off = 0, out_off = 0;
+    struct stat st;
+    ssize_t ret, got, done;
 
-static int wait_for_space(int fd, unsigned long how_much) {
-    int counter = 0;
-    struct statvfs fs_space;
-    do {
-        if (fstatvfs(fd, &fs_space) == -1) {
-            perror("fstatvfs");
-            return -1;
+    if (fstat(fdin, &st) == 0 && (unsigned long long)st.st_size == len &&
+            ioctl(fdout, FICLONE, fdin) == 0)
+        return 1;
+    while ((unsigned long long)out_off < len) {
+        ret = copy_file_range(fdin, &in_off, fdout, &out_off, len - out_off, 0);
+        if (ret < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+                        errno == EINVAL))
+            break;
+        if (ret <= 0)
+            return 0;
+    }
+    /* copy_file_range() not supported here */
+    while ((unsigned long long)out_off < len) {
+        got = pread(fdin, buf, len - out_off < sizeof(buf) ? len - out_off : sizeof(buf), out_off);
+        if (got <= 0)
+            return 0;
+        for (done = 0; done < got; done += ret) {
+            ret = pwrite(fdout, buf + done, got - done, out_off + done);
+            if (ret <= 0)
+                return 0;
         }
-        // TODO: timeout?
-        if (counter > 0)
-            usleep(1000000);
-        counter++;
-    } while (fs_space.f_bsize * fs_space.f_bavail < how_much);
-    return 0;
+        out_off += got;
+    }
+    return 1;
 }
 
-static unsigned long crc32_sum = 0;
-static int read_all_with_crc(int fd, void *buf, int size) {
-    int ret;
-    ret = read_all(fd, buf, size);
-    if (ret)
-        crc32_sum = Crc32_ComputeBuf(crc32_sum, buf, size);
-    return ret;
+/*
+ * Fill fdout from the hash cache; the result is checked against the hash,
+ * as cached files may have been modified since.  Returns 1 on success.
+ */
+static int copy_from_hash_cache(struct qfile_ctx *ctx, int fdout, unsigned long long len)
+{
+    struct unpack_state *us = ctx->unpack;
+    char name[2 * SHA256_DIGEST_SIZE + 1];
+    struct stat st;
+    int fd, ok = 0;
+
+    hash_to_name(us->untrusted_hash.sha256, name);
+    fd = openat(us->hash_cache_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (unsigned long long)st.st_size != len)
+        goto out;
+    ok = copy_contents(fd, fdout, len) && has_hash(fdout, len, us->untrusted_hash.sha256);
+out:
+    close(fd);
+    if (!ok && (ftruncate(fdout, 0) || lseek(fdout, 0, SEEK_SET)))
+        do_exit(ctx, errno, NULL);
+    return ok;
 }
 
-void send_status_and_crc(int code, const char *last_filename) {
+static void send_hash_reply(struct qfile_ctx *ctx, int hit)
+{
+    struct unpack_state *us = ctx->unpack;
     struct result_header hdr;
     struct result_header_ext hdr_ext;
-    int saved_errno;
 
-    saved_errno = errno;
-    hdr.error_code = code;
-    hdr._pad = 0;
-    hdr.crc32 = crc32_sum;
-    if (!write_all(1, &hdr, sizeof(hdr)))
-        perror("write status");
-    if (last_filename) {
-        hdr_ext.last_namelen = strlen(last_filename);
-        if (!write_all(1, &hdr_ext, sizeof(hdr_ext)))
-            perror("write status ext");
-        if (!write_all(1, last_filename, hdr_ext.last_namelen))
-            perror("write last_filename");
-    }
-    errno = saved_errno;
+    hdr.error_code = 0;
+    hdr._pad = hit;
+    hdr.crc32 = us->crc32_sum;
+    hdr_ext.last_namelen = 0;
+    if (!qfile_write_all(ctx, ctx->out_fd, &hdr, sizeof(hdr)) ||
+            !qfile_write_all(ctx, ctx->out_fd, &hdr_ext, sizeof(hdr_ext)))
+        do_exit(ctx, errno, NULL);
 }
 
-static long validate_utime_nsec(uint32_t untrusted_nsec)
+/*
+ * Data of a file announced with QFILE_EXT_HASH: taken from the cache if
+ * possible, otherwise received.  Returns 1 if the received data should be
+ * added to the cache.
+ */
+static int receive_hashed_data(struct qfile_ctx *ctx, int fdout, unsigned long long len,
+                               const char *untrusted_name)
 {
-    enum { MAX_NSEC = 999999999L };
-    if (untrusted_nsec > MAX_NSEC)
-        errx(1, "Invalid nanoseconds value %" PRIu32, untrusted_nsec);
-    return (long)untrusted_nsec;
+    struct unpack_state *us = ctx->unpack;
+    int hit;
+
+    us->hash_pending = 0;
+    hit = copy_from_hash_cache(ctx, fdout, len);
+    send_hash_reply(ctx, hit);
+    if (hit)
+        return 0;
+    receive_data(ctx, fdout, len, untrusted_name);
+    /* the file may have changed on the sending side in the meantime */
+    return has_hash(fdout, len, us->untrusted_hash.sha256);
 }
 
-static void fix_times_and_perms(const int fd,
-        const struct file_header *const untrusted_hdr,
-        const char *const untrusted_name)
+/*
+ * Best effort.  The cache gets a copy (or reflink) of its own, not a link to
+ * the received file, whose mode and times the sender controls.
+ */
+static void add_to_hash_cache(struct qfile_ctx *ctx, int fd, unsigned long long len)
 {
-    const struct timespec times[2] =
-    { 
-        {
-            .tv_sec = untrusted_hdr->atime,
-            .tv_nsec = validate_utime_nsec(untrusted_hdr->atime_nsec)
-        },
-        {
-            .tv_sec = untrusted_hdr->mtime,
-            .tv_nsec = validate_utime_nsec(untrusted_hdr->mtime_nsec)
-        },
-    };
-    /* Do not change the mode of symbolic links */
-    if (!S_ISLNK(untrusted_hdr->mode) &&
-            fchmod(fd, untrusted_hdr->mode & 07777))
-        do_exit(errno, untrusted_name);
-    if (futimens(fd, times))  /* as above */
-        do_exit(errno, untrusted_name);
+    struct unpack_state *us = ctx->unpack;
+    char cache_name[2 * SHA256_DIGEST_SIZE + 1];
+    char tmp_name[sizeof(cache_name) + 5];
+    int cache_fd, ok;
+
+    hash_to_name(us->untrusted_hash.sha256, cache_name);
+    snprintf(tmp_name, sizeof(tmp_name), ".tmp-%s", cache_name);
+    cache_fd = openat(us->hash_cache_fd, tmp_name,
+                      O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY, 0600);
+    if (cache_fd < 0)
+        return;
+    ok = copy_contents(fd, cache_fd, len);
+    close(cache_fd);
+    if (!ok || renameat(us->hash_cache_fd, tmp_name, us->hash_cache_fd, cache_name))
+        unlinkat(us->hash_cache_fd, tmp_name, 0);
 }
 
-// Open the second-to-last component of a path, enforcing O_NOFOLLOW for every
-// path component.  *last_segment will be set to the last segment of the path,
-// and points into the original path.  The original path is modified in-place,
-// so one should probably pass a copy.  The return value is either dirfd (if the
-// path has no / in it) or a newly opened file descriptor that must be closed by
-// the caller.  dirfd can be AT_FDCWD to indicate the current_directory.
-static int opendir_safe(int dirfd, char *path, const char **last_segment)
+/* the (empty) regular file after a QFILE_EXT_HARDLINK record */
+static void process_one_file_hardlink(struct qfile_ctx *ctx, const struct file_header *untrusted_hdr,
+                                      const char *untrusted_name,
+                                      uint32_t flags)
 {
-    assert(path && *path); // empty paths rejected earlier
-    char *this_segment = path, *next_segment = NULL;
-    *last_segment = NULL;
-    int cur_fd = dirfd;
-    for (;;this_segment = next_segment) {
-        assert(this_segment);
-        char *next = strchr(this_segment, '/');
-        if (next == NULL) {
-            *last_segment = this_segment;
-            return cur_fd;
-        }
-        *next = '\0';
-        next_segment = next + 1;
-        if ((next - this_segment <= 2) &&
-            (memcmp(this_segment, "..", (size_t)(next - this_segment)) == 0)) {
-            fprintf(stderr, "BUG: path component '%s' not rejected earlier!\n", this_segment);
-            abort();
-        }
-        int new_fd = openat(cur_fd, this_segment, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
-        if (new_fd == -1)
-            do_exit(errno, this_segment);
-        if (cur_fd != dirfd)
-            close(cur_fd);
-        cur_fd = new_fd;
+    struct unpack_state *us = ctx->unpack;
+    const char *target_last_segment, *last_segment;
+    char *target_dup, *path_dup;
+    int target_dirfd, safe_dirfd, ret;
+    struct stat buf;
+
+    us->link_pending = 0;
+    if (untrusted_hdr->filelen != 0)
+        do_exit(ctx, EINVAL, untrusted_name);
+    ret = qubes_pure_validate_file_name_v2((const uint8_t *)us->untrusted_link_target, flags);
+    if (ret != 0)
+        do_exit(ctx, -ret, untrusted_name);
+    target_dup = path_copy(ctx, us->link_path_buf, us->untrusted_link_target);
+    path_dup = path_copy(ctx, us->path_buf, untrusted_name);
+    /* opendir_safe() may reuse the fd for the second path */
+    ret = opendir_safe(ctx, ctx->dirfd, target_dup, &target_last_segment);
+    target_dirfd = ret == ctx->dirfd ? ctx->dirfd : fcntl(ret, F_DUPFD_CLOEXEC, 0);
+    if (target_dirfd == -1)
+        do_exit(ctx, errno, untrusted_name);
+    if (target_dirfd != ctx->dirfd)
+        us->entry_fd = target_dirfd;
+    closedir_safe(ctx, ret);
+    /*
+     * only link to regular files (not following symlinks) created by this
+     * transfer, not to anything that was in the directory before
+     */
+    if (fstatat(target_dirfd, target_last_segment, &buf, AT_SYMLINK_NOFOLLOW))
+        do_exit(ctx, errno, untrusted_name);
+    if (!S_ISREG(buf.st_mode) || !is_created_inode(ctx, &buf))
+        do_exit(ctx, EINVAL, untrusted_name);
+    safe_dirfd = opendir_safe(ctx, ctx->dirfd, path_dup, &last_segment);
+    journal_created(ctx, safe_dirfd, last_segment, untrusted_hdr, untrusted_name);
+    if (linkat(target_dirfd, target_last_segment, safe_dirfd, last_segment, 0)) {
+        journal_not_created(ctx);
+        do_exit(ctx, errno, untrusted_name);
     }
+    closedir_safe(ctx, safe_dirfd);
+    if (target_dirfd != ctx->dirfd)
+        close(target_dirfd);
+    us->entry_fd = -1;
 }
 
-static void process_one_file_reg(struct file_header *untrusted_hdr,
+static void process_one_file_reg(struct qfile_ctx *ctx, struct file_header *untrusted_hdr,
                                  const char *untrusted_name,
                                  uint32_t flags)
 {
-    int ret;
+    struct unpack_state *us = ctx->unpack;
+    unsigned long long data_len;
+    int ret, cache_it = 0;
     int fdout = -1, safe_dirfd;
     const char *last_segment;
     char *path_dup;
 
     ret = qubes_pure_validate_file_name_v2((const uint8_t *)untrusted_name, flags);
     if (ret != 0)
-        do_exit(-ret, untrusted_name); /* FIXME: better error message */
-    if ((path_dup = strdup(untrusted_name)) == NULL)
-        do_exit(ENOMEM, untrusted_name);
-    safe_dirfd = opendir_safe(AT_FDCWD, path_dup, &last_segment);
+        do_exit(ctx, -ret, untrusted_name); /* FIXME: better error message */
+    if (us->link_pending) {
+        process_one_file_hardlink(ctx, untrusted_hdr, untrusted_name, flags);
+        return;
+    }
+    if (us->hash_pending && us->untrusted_hash.size != untrusted_hdr->filelen)
+        do_exit(ctx, EINVAL, untrusted_name);
+    if (can_queue_file(ctx, untrusted_hdr)) {
+        queue_file(ctx, untrusted_hdr, untrusted_name);
+        return;
+    }
+    path_dup = path_copy(ctx, us->path_buf, untrusted_name);
+    safe_dirfd = opendir_safe(ctx, ctx->dirfd, path_dup, &last_segment);
 
     /* make the file inaccessible until fully written */
-    if (use_tmpfile) {
-        fdout = openat(safe_dirfd, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC | O_NOCTTY, 0700);
+    if (us->use_tmpfile) {
+        fdout = openat(safe_dirfd, ".", O_RDWR | O_TMPFILE | O_CLOEXEC | O_NOCTTY, 0700);
         if (fdout < 0) {
             if (errno==ENOENT || /* most likely, kernel too old for O_TMPFILE */
                     errno==EOPNOTSUPP) /* filesystem has no support for O_TMPFILE */
-                use_tmpfile = 0;
+                us->use_tmpfile = 0;
             else
-                do_exit(errno, untrusted_name);
+                do_exit(ctx, errno, untrusted_name);
         }
     }
 
-    if (fdout < 0)
-        fdout = openat(safe_dirfd, last_segment, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY, 0000);
-    if (fdout < 0)
-        do_exit(errno, untrusted_name);
+    if (fdout < 0) {
+        journal_created(ctx, safe_dirfd, last_segment, untrusted_hdr, untrusted_name);
+        fdout = openat(safe_dirfd, last_segment, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY, 0000);
+        if (fdout < 0) {
+            journal_not_created(ctx);
+            do_exit(ctx, errno, untrusted_name);
+        }
+    }
+    us->entry_fd = fdout;
+    record_created_file(ctx, fdout, untrusted_name);
 
     /* sizes are signed elsewhere */
-    if (untrusted_hdr->filelen > LLONG_MAX || (bytes_limit && untrusted_hdr->filelen > bytes_limit))
-        do_exit(EDQUOT, untrusted_name);
-    if (bytes_limit && total_bytes > bytes_limit - untrusted_hdr->filelen)
-        do_exit(EDQUOT, untrusted_name);
-    if (opt_wait_for_space_margin) {
-        wait_for_space(fdout,
-            untrusted_hdr->filelen + opt_wait_for_space_margin);
-    }
-    total_bytes += untrusted_hdr->filelen;
-    ret = copy_file(fdout, 0, untrusted_hdr->filelen, &crc32_sum);
-    if (ret != COPY_FILE_OK) {
-        if (ret == COPY_FILE_READ_EOF
-                || ret == COPY_FILE_READ_ERROR)
-            do_exit(LEGAL_EOF, untrusted_name); // hopefully remote will produce error message
+    if (untrusted_hdr->filelen > LLONG_MAX)
+        do_exit(ctx, EDQUOT, untrusted_name);
+    /* only the data of sparse files takes space */
+    if (us->sparse_count >= 0)
+        data_len = validate_extents(ctx, untrusted_hdr->filelen, untrusted_name);
+    else
+        data_len = untrusted_hdr->filelen;
+    if (us->bytes_limit && data_len > us->bytes_limit)
+        do_exit(ctx, EDQUOT, untrusted_name);
+    if (us->bytes_limit && us->total_bytes > us->bytes_limit - data_len)
+        do_exit(ctx, EDQUOT, untrusted_name);
+    if (us->opt_wait_for_space_margin) {
+        ret = wait_for_space(ctx, fdout, data_len);
+        if (ret)
+            do_exit(ctx, ret, untrusted_name);
+    }
+    us->total_bytes += data_len;
+    if (us->sparse_count >= 0) {
+        receive_sparse_data(ctx, fdout, untrusted_hdr->filelen, untrusted_name);
+    } else {
+        /* receive_data() reserves space as it goes, the others at the start */
+        if (us->compress_pending || us->stripe_pending) {
+            ret = preallocate_file(ctx, fdout, 0, untrusted_hdr->filelen);
+            if (ret)
+                do_exit(ctx, ret, untrusted_name);
+        }
+        if (us->hash_pending)
+            cache_it = receive_hashed_data(ctx, fdout, untrusted_hdr->filelen, untrusted_name);
+        else if (us->compress_pending)
+            receive_compressed_data(ctx, fdout, untrusted_hdr->filelen, untrusted_name);
+        else if (us->stripe_pending)
+            receive_striped_data(ctx, fdout, untrusted_hdr->filelen, untrusted_name);
         else
-            do_exit(errno, untrusted_name);
+            receive_data(ctx, fdout, untrusted_hdr->filelen, untrusted_name);
     }
-    if (use_tmpfile) {
+    if (us->use_tmpfile) {
         char fd_str[11];
         if ((unsigned)snprintf(fd_str, sizeof(fd_str), "%d", fdout) >= sizeof(fd_str))
             abort();
-        if (linkat(procdir_fd, fd_str, safe_dirfd, last_segment, AT_SYMLINK_FOLLOW) < 0)
-            do_exit(errno, untrusted_name);
+        journal_created(ctx, safe_dirfd, last_segment, untrusted_hdr, untrusted_name);
+        if (linkat(us->procdir_fd, fd_str, safe_dirfd, last_segment, AT_SYMLINK_FOLLOW) < 0) {
+            journal_not_created(ctx);
+            do_exit(ctx, errno, untrusted_name);
+        }
     }
-    fix_times_and_perms(fdout, untrusted_hdr, untrusted_name);
-    if (safe_dirfd != AT_FDCWD)
-        close(safe_dirfd);
-    close(fdout);
-    free(path_dup);
+    us->prealloc_fd = -1;
+    fix_times_and_perms(ctx, fdout, untrusted_hdr, untrusted_name);
+    if (cache_it)
+        add_to_hash_cache(ctx, fdout, untrusted_hdr->filelen);
+    closedir_safe(ctx, safe_dirfd);
+    us->entry_fd = -1;
+    if (us->opt_incremental_sync)
+        add_writeback(ctx, fdout, untrusted_name);
+    else
+        close(fdout);
+}
+
+
+static void add_dir_fixup(struct qfile_ctx *ctx, const struct file_header *untrusted_hdr,
+                          const char *untrusted_name)
+{
+    struct unpack_state *us = ctx->unpack;
+    size_t namelen = strlen(untrusted_name) + 1;
+    struct dir_fixup *fixup;
+    const char *p;
+
+    if ((us->dir_fixups_count + 1) * sizeof(*us->dir_fixups) +
+            us->dir_fixup_names_len + namelen > DIR_FIXUPS_MAX)
+        do_exit(ctx, ENOMEM, untrusted_name);
+    if (us->dir_fixups_count == us->dir_fixups_size) {
+        size_t new_size = us->dir_fixups_size ? us->dir_fixups_size * 2 : 64;
+        if (new_size > DIR_FIXUPS_MAX / sizeof(*us->dir_fixups))
+            new_size = DIR_FIXUPS_MAX / sizeof(*us->dir_fixups);
+        fixup = realloc(us->dir_fixups, new_size * sizeof(*us->dir_fixups));
+        if (!fixup)
+            do_exit(ctx, ENOMEM, untrusted_name);
+        us->dir_fixups = fixup;
+        us->dir_fixups_size = new_size;
+    }
+    if (us->dir_fixup_names_len + namelen > us->dir_fixup_names_size) {
+        size_t new_size = us->dir_fixup_names_size ? us->dir_fixup_names_size : 4096;
+        char *names;
+        while (new_size < us->dir_fixup_names_len + namelen)
+            new_size *= 2;
+        if (new_size > DIR_FIXUPS_MAX)
+            new_size = DIR_FIXUPS_MAX;
+        if ((names = realloc(us->dir_fixup_names, new_size)) == NULL)
+            do_exit(ctx, ENOMEM, untrusted_name);
+        us->dir_fixup_names = names;
+        us->dir_fixup_names_size = new_size;
+    }
+    fixup = &us->dir_fixups[us->dir_fixups_count++];
+    fixup->hdr = *untrusted_hdr;
+    fixup->name_offset = us->dir_fixup_names_len;
+    fixup->depth = 0;
+    for (p = untrusted_name; *p; p++)
+        fixup->depth += *p == '/';
+    memcpy(us->dir_fixup_names + us->dir_fixup_names_len, untrusted_name, namelen);
+    us->dir_fixup_names_len += namelen;
+}
+
+/* deepest first, and among the same depth in reverse stream order */
+static int compare_dir_fixups(const void *a, const void *b)
+{
+    const struct dir_fixup *fa = a, *fb = b;
+
+    if (fa->depth != fb->depth)
+        return fa->depth < fb->depth ? 1 : -1;
+    if (fa->name_offset != fb->name_offset)
+        return fa->name_offset < fb->name_offset ? 1 : -1;
+    return 0;
 }
 
+static void apply_dir_fixups(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct dir_fixup *fixup;
+    const char *last_segment;
+    char *untrusted_name, *path_dup;
+    struct stat buf;
+    int safe_dirfd, dirfd;
+    size_t i;
+
+    qsort(us->dir_fixups, us->dir_fixups_count, sizeof(*us->dir_fixups), compare_dir_fixups);
+    for (i = 0; i < us->dir_fixups_count; i++) {
+        fixup = &us->dir_fixups[i];
+        untrusted_name = us->dir_fixup_names + fixup->name_offset;
+        path_dup = path_copy(ctx, us->path_buf, untrusted_name);
+        safe_dirfd = opendir_safe(ctx, ctx->dirfd, path_dup, &last_segment);
+        dirfd = openat(safe_dirfd, last_segment, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECTORY);
+        us->entry_fd = dirfd;
+        if (dirfd < 0 || fstat(dirfd, &buf) < 0)
+            do_exit(ctx, errno, untrusted_name);
+        us->total_bytes += buf.st_size;
+        fix_times_and_perms(ctx, dirfd, &fixup->hdr, untrusted_name);
+        us->entry_fd = -1;
+        close(dirfd);
+        closedir_safe(ctx, safe_dirfd);
+    }
+    us->dir_fixups_count = 0;
+    us->dir_fixup_names_len = 0;
+}
 
-static void process_one_file_dir(struct file_header *untrusted_hdr,
+static void process_one_file_dir(struct qfile_ctx *ctx, struct file_header *untrusted_hdr,
                                  const char *untrusted_name,
                                  uint32_t flags)
 {
+    struct unpack_state *us = ctx->unpack;
     int safe_dirfd;
     const char *last_segment;
     char *path_dup;
     int rc = qubes_pure_validate_file_name_v2((const uint8_t *)untrusted_name, flags);
     if (rc != 0)
-        do_exit(rc, untrusted_name); /* FIXME: better error message */
-    if ((path_dup = strdup(untrusted_name)) == NULL)
-        do_exit(ENOMEM, untrusted_name);
-    safe_dirfd = opendir_safe(AT_FDCWD, path_dup, &last_segment);
+        do_exit(ctx, rc, untrusted_name); /* FIXME: better error message */
+    path_dup = path_copy(ctx, us->path_buf, untrusted_name);
+    safe_dirfd = opendir_safe(ctx, ctx->dirfd, path_dup, &last_segment);
+
+    if (us->negotiated_features & QFILE_FEATURE_DIR_ONCE) {
+        if (mkdirat(safe_dirfd, last_segment, 0700) == 0)
+            journal_write(ctx, JOURNAL_CREATED, untrusted_hdr, untrusted_name);
+        else if (errno != EEXIST)
+            do_exit(ctx, errno, untrusted_name);
+        add_dir_fixup(ctx, untrusted_hdr, untrusted_name);
+        closedir_safe(ctx, safe_dirfd);
+        return;
+    }
 
     // fix perms only when the directory is sent for the second time
     // it allows to transfer r.x directory contents, as we create it rwx initially
     struct stat buf;
     if (!mkdirat(safe_dirfd, last_segment, 0700)) {
-        close(safe_dirfd);
+        journal_write(ctx, JOURNAL_CREATED, untrusted_hdr, untrusted_name);
+        closedir_safe(ctx, safe_dirfd);
         return;
     }
     if (errno != EEXIST)
-        do_exit(errno, untrusted_name);
+        do_exit(ctx, errno, untrusted_name);
     int new_dirfd = openat(safe_dirfd, last_segment, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECTORY);
+    us->entry_fd = new_dirfd;
     if (new_dirfd < 0 || fstat(new_dirfd, &buf) < 0)
-        do_exit(errno, untrusted_name);
-    total_bytes += buf.st_size;
+        do_exit(ctx, errno, untrusted_name);
+    us->total_bytes += buf.st_size;
     /* size accumulated after the fact, so don't check limit here */
-    fix_times_and_perms(new_dirfd, untrusted_hdr, untrusted_name);
+    fix_times_and_perms(ctx, new_dirfd, untrusted_hdr, untrusted_name);
+    us->entry_fd = -1;
     close(new_dirfd);
-    if (safe_dirfd != AT_FDCWD)
-        close(safe_dirfd);
-    free(path_dup);
+    closedir_safe(ctx, safe_dirfd);
 }
 
-static void process_one_file_link(struct file_header *untrusted_hdr,
+static void process_one_file_link(struct qfile_ctx *ctx, struct file_header *untrusted_hdr,
                                   const char *untrusted_name,
                                   uint32_t flags)
 {
+    struct unpack_state *us = ctx->unpack;
     char untrusted_content[MAX_PATH_LENGTH];
     const char *last_segment;
     char *path_dup;
     unsigned int filelen;
     int safe_dirfd;
     if (untrusted_hdr->filelen > MAX_PATH_LENGTH - 1)
-        do_exit(ENAMETOOLONG, untrusted_name);
+        do_exit(ctx, ENAMETOOLONG, untrusted_name);
 
     filelen = untrusted_hdr->filelen; /* sanitized above */
-    total_bytes += filelen;
-    if (bytes_limit && total_bytes > bytes_limit)
-        do_exit(EDQUOT, untrusted_name);
-    if (!read_all_with_crc(0, untrusted_content, filelen))
-        do_exit(LEGAL_EOF, untrusted_name); // hopefully remote has produced error message
+    us->total_bytes += filelen;
+    if (us->bytes_limit && us->total_bytes > us->bytes_limit)
+        do_exit(ctx, EDQUOT, untrusted_name);
+    if (!read_all_with_crc(ctx, ctx->in_fd, untrusted_content, filelen))
+        do_exit(ctx, LEGAL_EOF, untrusted_name); // hopefully remote has produced error message
     untrusted_content[filelen] = 0;
     /*
      * Sanitize both the path of the symbolic link and its target.
@@ -315,79 +1893,481 @@ static void process_one_file_link(struct file_header *untrusted_hdr,
                                                   (const uint8_t *)untrusted_content,
                                                   flags);
     if (rc != 0)
-        do_exit(-rc, untrusted_content);
+        do_exit(ctx, -rc, untrusted_content);
+
+    path_dup = path_copy(ctx, us->path_buf, untrusted_name);
+    safe_dirfd = opendir_safe(ctx, ctx->dirfd, path_dup, &last_segment);
+
+    journal_created(ctx, safe_dirfd, last_segment, untrusted_hdr, untrusted_name);
+    if (symlinkat(untrusted_content, safe_dirfd, last_segment)) {
+        journal_not_created(ctx);
+        do_exit(ctx, errno, untrusted_name);
+    }
+
+    closedir_safe(ctx, safe_dirfd);
+}
+
+/* answer QFILE_EXT_HELLO with the accepted features */
+static void send_features(struct qfile_ctx *ctx, uint32_t features)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct result_header hdr;
+    struct result_header_ext hdr_ext;
+
+    hdr.error_code = 0;
+    hdr._pad = features;
+    hdr.crc32 = us->crc32_sum;
+    hdr_ext.last_namelen = 0;
+    if (!qfile_write_all(ctx, ctx->out_fd, &hdr, sizeof(hdr)) ||
+            !qfile_write_all(ctx, ctx->out_fd, &hdr_ext, sizeof(hdr_ext)))
+        do_exit(ctx, errno, NULL);
+    if (features & QFILE_FEATURE_STRIPE) {
+        struct qfile_ext_stripe stripe = { us->stripe.count, 0 };
+        if (!qfile_write_all(ctx, ctx->out_fd, &stripe, sizeof(stripe)))
+            do_exit(ctx, errno, NULL);
+    }
+}
+
+/* remove an entry created but not completed before the interruption */
+static void remove_incomplete_entry(struct qfile_ctx *ctx, char *untrusted_name)
+{
+    const char *last_segment;
+    struct stat buf;
+    int safe_dirfd;
+
+    safe_dirfd = opendir_safe(ctx, ctx->dirfd, untrusted_name, &last_segment);
+    /* directories are fine to be reused (and may have contents already) */
+    if (fstatat(safe_dirfd, last_segment, &buf, AT_SYMLINK_NOFOLLOW) == 0 &&
+            !S_ISDIR(buf.st_mode) &&
+            unlinkat(safe_dirfd, last_segment, 0))
+        do_exit(ctx, errno, untrusted_name);
+    closedir_safe(ctx, safe_dirfd);
+}
+
+/*
+ * Read the journal of the interrupted transfer, clean up after it and tell
+ * the sender where to continue.
+ */
+/* a regular file completed by the interrupted transfer, if still there */
+static void record_journaled_file(struct qfile_ctx *ctx, const char *name)
+{
+    struct unpack_state *us = ctx->unpack;
+    const char *last_segment;
+    struct stat st;
+    int dirfd;
+
+    if (!(us->negotiated_features & QFILE_FEATURE_HARDLINK))
+        return;
+    dirfd = opendir_safe(ctx, ctx->dirfd, path_copy(ctx, us->path_buf, name), &last_segment);
+    if (fstatat(dirfd, last_segment, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode))
+        record_created_inode(ctx, st.st_dev, st.st_ino, name);
+    closedir_safe(ctx, dirfd);
+}
+
+static void journal_resume(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct qfile_resume_point point = { 0, 0, 0 };
+    struct journal_record rec;
+    unsigned long long total_bytes = 0;
+    char name[MAX_PATH_LENGTH], last_name[MAX_PATH_LENGTH] = "";
+    char incomplete[MAX_PATH_LENGTH] = "";
+    off_t offset = 0, done_offset = 0;
+    FILE *f;
+    int fd;
 
-    if ((path_dup = strdup(untrusted_name)) == NULL)
-        do_exit(ENOMEM, untrusted_name);
-    safe_dirfd = opendir_safe(AT_FDCWD, path_dup, &last_segment);
+    if ((fd = dup(us->journal_fd)) < 0 || (f = fdopen(fd, "r")) == NULL)
+        do_exit(ctx, errno, NULL);
+    rewind(f);
+    /* a truncated record at the end is ignored */
+    while (fread(&rec, sizeof(rec), 1, f) == 1 &&
+            rec.hdr.namelen > 0 && rec.hdr.namelen <= sizeof(name) &&
+            fread(name, rec.hdr.namelen, 1, f) == 1) {
+        name[rec.hdr.namelen - 1] = 0;
+        offset += sizeof(rec) + rec.hdr.namelen;
+        if (rec.type == JOURNAL_CREATED) {
+            strcpy(incomplete, name);
+            continue;
+        }
+        incomplete[0] = 0;
+        strcpy(last_name, name);
+        point.entries++;
+        point.crc32 = rec.crc32;
+        total_bytes = rec.total_bytes;
+        done_offset = offset;
+        if (S_ISDIR(rec.hdr.mode) && (us->negotiated_features & QFILE_FEATURE_DIR_ONCE))
+            add_dir_fixup(ctx, &rec.hdr, name);
+        if (S_ISREG(rec.hdr.mode))
+            record_journaled_file(ctx, name);
+    }
+    fclose(f);
+    if (incomplete[0])
+        remove_incomplete_entry(ctx, incomplete);
+    if (ftruncate(us->journal_fd, done_offset) || lseek(us->journal_fd, done_offset, SEEK_SET) < 0)
+        do_exit(ctx, errno, NULL);
+    point.namelen = strlen(last_name);
+    if (!qfile_write_all(ctx, ctx->out_fd, &point, sizeof(point)) ||
+            !qfile_write_all(ctx, ctx->out_fd, last_name, point.namelen))
+        do_exit(ctx, errno, NULL);
+    /* continue the checksum of the interrupted transfer */
+    if (point.entries)
+        us->crc32_sum = point.crc32;
+    /* the limits apply to the whole transfer, not to each part of it */
+    us->total_files = point.entries;
+    us->total_bytes = total_bytes;
+}
 
-    if (symlinkat(untrusted_content, safe_dirfd, last_segment))
-        do_exit(errno, untrusted_name);
+static void process_ext_record(struct qfile_ctx *ctx, struct file_header *untrusted_hdr,
+                               int first_record)
+{
+    struct unpack_state *us = ctx->unpack;
+    char untrusted_name;
+    struct qfile_ext_hello untrusted_hello;
+    unsigned long long filelen = untrusted_hdr->filelen;
 
-    if (safe_dirfd != AT_FDCWD)
-        close(safe_dirfd);
-    free(path_dup);
+    if (untrusted_hdr->namelen != 1)
+        do_exit(ctx, EINVAL, NULL);
+    if (!read_all_with_crc(ctx, ctx->in_fd, &untrusted_name, 1))
+        do_exit(ctx, LEGAL_EOF, NULL);
+    if (untrusted_name != '\0')
+        do_exit(ctx, EINVAL, NULL);
+    switch (untrusted_hdr->mode & ~QFILE_S_IFEXT) {
+        case QFILE_EXT_HELLO:
+            if (!first_record || filelen != sizeof(untrusted_hello))
+                do_exit(ctx, EINVAL, NULL);
+            if (!read_all_with_crc(ctx, ctx->in_fd, &untrusted_hello, sizeof(untrusted_hello)))
+                do_exit(ctx, LEGAL_EOF, NULL);
+            us->negotiated_features = untrusted_hello.features & us->unpack_features;
+            if (us->hash_cache_fd < 0)
+                us->negotiated_features &= ~QFILE_FEATURE_HASH_SKIP;
+            if (us->journal_fd < 0)
+                us->negotiated_features &= ~QFILE_FEATURE_RESUME;
+            us->negotiated_features &= ~((QFILE_FEATURE_ZSTD | QFILE_FEATURE_LZ4) &
+                                     ~compress_features());
+            /* the channel threads are started now, or the channels are not used */
+            if (!us->stripe.count || stripe_start(&us->stripe) < 0)
+                us->negotiated_features &= ~QFILE_FEATURE_STRIPE;
+            send_features(ctx, us->negotiated_features);
+            if (us->negotiated_features & QFILE_FEATURE_RESUME)
+                journal_resume(ctx);
+            else
+                journal_reset(ctx);
+            break;
+        case QFILE_EXT_SPARSE:
+            if (!(us->negotiated_features & QFILE_FEATURE_SPARSE) ||
+                    us->sparse_count >= 0 || us->link_pending || us->hash_pending ||
+                    us->compress_pending || us->stripe_pending ||
+                    filelen > sizeof(us->untrusted_extents) ||
+                    filelen % sizeof(us->untrusted_extents[0]))
+                do_exit(ctx, EINVAL, NULL);
+            if (!read_all_with_crc(ctx, ctx->in_fd, us->untrusted_extents, filelen))
+                do_exit(ctx, LEGAL_EOF, NULL);
+            /* validated against the file size in process_one_file_reg() */
+            us->sparse_count = filelen / sizeof(us->untrusted_extents[0]);
+            break;
+        case QFILE_EXT_HARDLINK:
+            if (!(us->negotiated_features & QFILE_FEATURE_HARDLINK) ||
+                    us->sparse_count >= 0 || us->link_pending || us->hash_pending ||
+                    us->compress_pending || us->stripe_pending ||
+                    filelen < 2 || filelen > sizeof(us->untrusted_link_target))
+                do_exit(ctx, EINVAL, NULL);
+            if (!read_all_with_crc(ctx, ctx->in_fd, us->untrusted_link_target, filelen))
+                do_exit(ctx, LEGAL_EOF, NULL);
+            /* exactly one NUL, at the end; validated in process_one_file_hardlink() */
+            if (strnlen(us->untrusted_link_target, filelen) != filelen - 1)
+                do_exit(ctx, EINVAL, NULL);
+            us->link_pending = 1;
+            break;
+        case QFILE_EXT_HASH:
+            if (!(us->negotiated_features & QFILE_FEATURE_HASH_SKIP) ||
+                    us->sparse_count >= 0 || us->link_pending || us->hash_pending ||
+                    us->compress_pending || us->stripe_pending ||
+                    filelen != sizeof(us->untrusted_hash))
+                do_exit(ctx, EINVAL, NULL);
+            if (!read_all_with_crc(ctx, ctx->in_fd, &us->untrusted_hash, sizeof(us->untrusted_hash)))
+                do_exit(ctx, LEGAL_EOF, NULL);
+            /* checked against the file header in process_one_file_reg() */
+            us->hash_pending = 1;
+            break;
+        case QFILE_EXT_COMPRESS: {
+            struct qfile_ext_compress untrusted_compress;
+            if (us->sparse_count >= 0 || us->link_pending || us->hash_pending ||
+                    us->compress_pending || us->stripe_pending ||
+                    filelen != sizeof(untrusted_compress))
+                do_exit(ctx, EINVAL, NULL);
+            if (!read_all_with_crc(ctx, ctx->in_fd, &untrusted_compress, sizeof(untrusted_compress)))
+                do_exit(ctx, LEGAL_EOF, NULL);
+            if (!((untrusted_compress.codec == QFILE_CODEC_ZSTD &&
+                            (us->negotiated_features & QFILE_FEATURE_ZSTD)) ||
+                        (untrusted_compress.codec == QFILE_CODEC_LZ4 &&
+                            (us->negotiated_features & QFILE_FEATURE_LZ4))))
+                do_exit(ctx, EINVAL, NULL);
+            us->compress_pending = untrusted_compress.codec;
+            break;
+        }
+        case QFILE_EXT_STRIPE: {
+            struct qfile_ext_stripe untrusted_stripe;
+            if (!(us->negotiated_features & QFILE_FEATURE_STRIPE) ||
+                    us->sparse_count >= 0 || us->link_pending || us->hash_pending ||
+                    us->compress_pending || us->stripe_pending ||
+                    filelen != sizeof(untrusted_stripe))
+                do_exit(ctx, EINVAL, NULL);
+            if (!read_all_with_crc(ctx, ctx->in_fd, &untrusted_stripe, sizeof(untrusted_stripe)))
+                do_exit(ctx, LEGAL_EOF, NULL);
+            if (untrusted_stripe.channels < 1 || untrusted_stripe.channels > us->stripe.count)
+                do_exit(ctx, EINVAL, NULL);
+            us->stripe_pending = untrusted_stripe.channels;
+            break;
+        }
+        default:
+            do_exit(ctx, EINVAL, NULL);
+    }
 }
 
-static void process_one_file(struct file_header *untrusted_hdr, int flags)
+static void process_one_file(struct qfile_ctx *ctx, struct file_header *untrusted_hdr, int flags)
 {
+    struct unpack_state *us = ctx->unpack;
     unsigned int namelen;
     if (untrusted_hdr->namelen > MAX_PATH_LENGTH - 1)
-        do_exit(ENAMETOOLONG, NULL); /* filename too long so not received at all */
+        do_exit(ctx, ENAMETOOLONG, NULL); /* filename too long so not received at all */
     namelen = untrusted_hdr->namelen; /* sanitized above */
     // Never set QUBES_PURE_ALLOW_NON_CANONICAL_PATHS -- paths from qfile-agent
     // will always be canonical.
     uint32_t validate_flags = ((uint32_t)flags >> 2) &
         (QUBES_PURE_ALLOW_UNSAFE_CHARACTERS | QUBES_PURE_ALLOW_UNSAFE_SYMLINKS |
          QUBES_PURE_ALLOW_NON_CANONICAL_SYMLINKS);
-    if (!read_all_with_crc(0, untrusted_namebuf, namelen))
-        do_exit(LEGAL_EOF, NULL); // hopefully remote has produced error message
-    untrusted_namebuf[namelen] = 0;
+    if (!read_all_with_crc(ctx, ctx->in_fd, us->untrusted_namebuf, namelen))
+        do_exit(ctx, LEGAL_EOF, NULL); // hopefully remote has produced error message
+    us->untrusted_namebuf[namelen] = 0;
+    /* only small files in the same directory may be in flight together */
+    if (!can_queue_file(ctx, untrusted_hdr))
+        drain_work(ctx);
+    /* extent map, link target, hash, codec or striping must be followed by a regular file */
+    if ((us->sparse_count >= 0 || us->link_pending || us->hash_pending || us->compress_pending ||
+                us->stripe_pending) &&
+            !S_ISREG(untrusted_hdr->mode))
+        do_exit(ctx, EINVAL, us->untrusted_namebuf);
     if (S_ISREG(untrusted_hdr->mode))
-        process_one_file_reg(untrusted_hdr, untrusted_namebuf, validate_flags);
+        process_one_file_reg(ctx, untrusted_hdr, us->untrusted_namebuf, validate_flags);
     else if (S_ISLNK(untrusted_hdr->mode) && (flags & COPY_ALLOW_SYMLINKS))
-        process_one_file_link(untrusted_hdr, untrusted_namebuf, validate_flags);
+        process_one_file_link(ctx, untrusted_hdr, us->untrusted_namebuf, validate_flags);
     else if (S_ISDIR(untrusted_hdr->mode) && (flags & COPY_ALLOW_DIRECTORIES))
-        process_one_file_dir(untrusted_hdr, untrusted_namebuf, validate_flags);
+        process_one_file_dir(ctx, untrusted_hdr, us->untrusted_namebuf, validate_flags);
     else
-        do_exit(EINVAL, untrusted_namebuf);
-    if (verbose && !S_ISDIR(untrusted_hdr->mode))
-        fprintf(stderr, "%s\n", untrusted_namebuf);
-}
-
-int do_unpack(void) {
-    return do_unpack_ext(COPY_ALLOW_DIRECTORIES | COPY_ALLOW_SYMLINKS);
+        do_exit(ctx, EINVAL, us->untrusted_namebuf);
+    journal_write(ctx, JOURNAL_DONE, untrusted_hdr, us->untrusted_namebuf);
+    if (us->verbose && !S_ISDIR(untrusted_hdr->mode))
+        fprintf(stderr, "%s\n", us->untrusted_namebuf);
 }
 
-int do_unpack_ext(int flags)
+int qfile_ctx_unpack(struct qfile_ctx *ctx, int flags)
 {
+    struct unpack_state *us = ctx->unpack;
     struct file_header untrusted_hdr;
     int end_of_transfer_marker_seen = 0;
+    int first_record = 1;
     int cwd_fd;
     int saved_errno;
+    int ret;
 
-    total_bytes = total_files = 0;
+    us->total_bytes = us->total_files = 0;
+    us->negotiated_features = 0;
+    us->sparse_count = -1;
+    us->link_pending = 0;
+    us->hash_pending = 0;
+    us->compress_pending = 0;
+    us->stripe_pending = 0;
+    us->created_inodes_count = 0;
+    if (us->created_inodes_size)
+        memset(us->created_inodes, 0, us->created_inodes_size * sizeof(*us->created_inodes));
+    us->dir_fixups_count = 0;
+    us->dir_fixup_names_len = 0;
+    us->inbuf_start = us->inbuf_end = 0;
+    us->space_budget_valid = 0;
+    probe_openat2(ctx);
+    start_workers(ctx);
+    us->writeback_head = us->writeback_count = 0;
     /* initialize checksum */
-    crc32_sum = 0;
-    while (read_all_with_crc(0, &untrusted_hdr, sizeof untrusted_hdr)) {
+    us->crc32_sum = 0;
+    while (read_all_with_crc(ctx, ctx->in_fd, &untrusted_hdr, sizeof untrusted_hdr)) {
         if (untrusted_hdr.namelen == 0) {
             end_of_transfer_marker_seen = 1;
             errno = 0;
             break;
         }
-        total_files++;
-        if (files_limit && total_files > files_limit)
-            do_exit(EDQUOT, untrusted_namebuf);
-        process_one_file(&untrusted_hdr, flags);
+        if ((untrusted_hdr.mode & S_IFMT) == QFILE_S_IFEXT) {
+            drain_work(ctx);
+            process_ext_record(ctx, &untrusted_hdr, first_record);
+            first_record = 0;
+            continue;
+        }
+        if (first_record)
+            journal_reset(ctx);
+        first_record = 0;
+        us->total_files++;
+        if (us->files_limit && us->total_files > us->files_limit)
+            do_exit(ctx, EDQUOT, us->untrusted_namebuf);
+        process_one_file(ctx, &untrusted_hdr, flags);
     }
     if (!end_of_transfer_marker_seen && !errno)
         errno = EREMOTEIO;
 
     saved_errno = errno;
-    cwd_fd = open(".", O_RDONLY);
-    if (cwd_fd >= 0 && syncfs(cwd_fd) == 0 && close(cwd_fd) == 0)
-        errno = saved_errno;
+    stop_workers(ctx);
+    stripe_stop(&us->stripe);
+    if (end_of_transfer_marker_seen) {
+        apply_dir_fixups(ctx);
+        journal_reset(ctx);
+    }
+    dircache_truncate(ctx, 0);
+    if (us->opt_incremental_sync) {
+        ret = finish_writeback(ctx);
+        errno = ret ? ret : saved_errno;
+    } else {
+        if (ctx->dirfd == AT_FDCWD) {
+            cwd_fd = open(".", O_RDONLY);
+            if (cwd_fd >= 0 && syncfs(cwd_fd) == 0 && close(cwd_fd) == 0)
+                errno = saved_errno;
+        } else if (syncfs(ctx->dirfd) == 0) {
+            errno = saved_errno;
+        }
+    }
 
-    send_status_and_crc(errno, untrusted_namebuf);
+    send_result(ctx, errno, us->untrusted_namebuf);
     return errno;
 }
+
+/*
+ * Release what a driven transfer that failed (or was freed) in the middle
+ * holds.  The workers finish the files already queued, unless one failed.
+ */
+void unpack_abort(struct qfile_ctx *ctx)
+{
+    struct unpack_state *us = ctx->unpack;
+    struct unpack_work *w;
+    unsigned long i;
+
+    release_preallocation(ctx);
+    if (us->work.nthreads) {
+        pthread_mutex_lock(&us->work.lock);
+        us->work.stop = 1;
+        pthread_cond_broadcast(&us->work.queued);
+        pthread_mutex_unlock(&us->work.lock);
+        for (i = 0; i < (unsigned long)us->work.nthreads; i++)
+            pthread_join(us->work.threads[i], NULL);
+        us->work.nthreads = 0;
+    }
+    stripe_stop(&us->stripe);
+    /* including the item being set up at tail */
+    for (i = us->work.head; i <= us->work.tail; i++) {
+        w = &us->work.items[i % WORK_QUEUE_SIZE];
+        if (w->close_dirfd)
+            close(w->dirfd);
+        if (w->state == WORK_DONE && w->fd >= 0)
+            close(w->fd);
+        free(w->name);
+        free(w->data);
+        memset(w, 0, sizeof(*w));
+    }
+    us->work.head = us->work.next = us->work.tail = 0;
+    dircache_truncate(ctx, 0);
+    if (us->dircache.uncached_fd >= 0) {
+        close(us->dircache.uncached_fd);
+        us->dircache.uncached_fd = -1;
+    }
+    while (us->writeback_count) {
+        close(us->writeback_fds[us->writeback_head]);
+        us->writeback_head = (us->writeback_head + 1) % WRITEBACK_MAX_FILES;
+        us->writeback_count--;
+    }
+    if (us->entry_fd >= 0) {
+        close(us->entry_fd);
+        us->entry_fd = -1;
+    }
+}
+
+static int unpack_body(struct qfile_ctx *ctx, void *data)
+{
+    int ret = qfile_ctx_unpack(ctx, (int)(intptr_t)data);
+
+    if (ret)
+        qfile_set_error(ctx, "%s", strerror(ret));
+    return ret;
+}
+
+int qfile_ctx_start_unpack(struct qfile_ctx *ctx, int flags)
+{
+    return qfile_driver_start(ctx, unpack_body, (void *)(intptr_t)flags);
+}
+
+/* the traditional API, on the default context */
+
+void send_status_and_crc(int code, const char *last_filename)
+{
+    send_result(qfile_default_ctx(), code, last_filename);
+}
+
+int do_unpack(void)
+{
+    return do_unpack_ext(COPY_ALLOW_DIRECTORIES | COPY_ALLOW_SYMLINKS);
+}
+
+int do_unpack_ext(int flags)
+{
+    return qfile_ctx_unpack(qfile_default_ctx(), flags);
+}
+
+void set_size_limit(unsigned long long new_bytes_limit, unsigned long long new_files_limit)
+{
+    qfile_ctx_set_size_limit(qfile_default_ctx(), new_bytes_limit, new_files_limit);
+}
+
+void set_verbose(int value)
+{
+    qfile_ctx_set_verbose(qfile_default_ctx(), value);
+}
+
+void set_wait_for_space(unsigned long value)
+{
+    qfile_ctx_set_wait_for_space(qfile_default_ctx(), value);
+}
+
+void set_wait_for_space_timeout(unsigned int seconds)
+{
+    qfile_ctx_set_wait_for_space_timeout(qfile_default_ctx(), seconds);
+}
+
+void set_procfs_fd(int value)
+{
+    qfile_ctx_set_procfs_fd(qfile_default_ctx(), value);
+}
+
+void set_unpack_threads(int value)
+{
+    qfile_ctx_set_unpack_threads(qfile_default_ctx(), value);
+}
+
+void set_incremental_sync(int value)
+{
+    qfile_ctx_set_incremental_sync(qfile_default_ctx(), value);
+}
+
+int set_unpack_hash_cache(int dirfd, const char *source_qube)
+{
+    return qfile_ctx_set_unpack_hash_cache(qfile_default_ctx(), dirfd, source_qube);
+}
+
+void set_unpack_journal(int fd)
+{
+    qfile_ctx_set_unpack_journal(qfile_default_ctx(), fd);
+}
+
+void set_unpack_features(uint32_t features)
+{
+    qfile_ctx_set_unpack_features(qfile_default_ctx(), features);
+}
+
+void set_unpack_channels(const int *fds, unsigned int count)
+{
+    qfile_ctx_set_unpack_channels(qfile_default_ctx(), fds, count);
+}